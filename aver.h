@@ -2,7 +2,24 @@
 
 /* Sliding window average */
 
-#define AVER_WND_LEN 16
+/*
+ * The window length is the power of 2 chosen at compile time
+ * so the average is calculated by shift without division.
+ */
+#ifndef AVER_WND_BITS
+#define AVER_WND_BITS 4
+#endif
+
+#define AVER_WND_LEN (1 << AVER_WND_BITS)
+
+/*
+ * Uncomment to use exponential moving average with the same time constant
+ * instead of the plain window. Its state is O(1) so it takes 6 bytes
+ * instead of 2 * AVER_WND_LEN + 6.
+ */
+//#define AVER_EMA
+
+#ifndef AVER_EMA
 
 struct aver_ctx {
 	int	val[AVER_WND_LEN];
@@ -11,6 +28,16 @@ struct aver_ctx {
 	long 	total;
 };
 
+#else
+
+struct aver_ctx {
+	long 	total; // Average value multiplied by AVER_WND_LEN
+	char	next;  // The number of values put since the last window end
+	char	ready;
+};
+
+#endif
+
 /* Reset state to empty */
 static inline void aver_reset(struct aver_ctx* ctx)
 {
@@ -28,10 +55,17 @@ static inline int aver_empty(struct aver_ctx const* ctx)
 /* Put new value */
 static inline void aver_put(struct aver_ctx* ctx, int val)
 {
+#ifndef AVER_EMA
 	ctx->total += val;
 	if (ctx->ready)
 		ctx->total -= ctx->val[ctx->next];
 	ctx->val[ctx->next] = val;
+#else
+	if (aver_empty(ctx))
+		ctx->total = (long)val << AVER_WND_BITS;
+	else
+		ctx->total += val - (ctx->total >> AVER_WND_BITS);
+#endif
 	if (++ctx->next >= AVER_WND_LEN) {
 		ctx->next  = 0;
 		ctx->ready = 1;
@@ -41,13 +75,13 @@ static inline void aver_put(struct aver_ctx* ctx, int val)
 /* Returns average value. Should be called only if ctx->ready != 0 */
 static inline int aver_value(struct aver_ctx const* ctx)
 {
-	return ctx->total / AVER_WND_LEN;
+	return ctx->total >> AVER_WND_BITS;
 }
 
 /* Returns average value multiplied by given factor. */
 static inline int aver_value_scaled(struct aver_ctx const* ctx, int scale)
 {
-	return (ctx->total * scale) / AVER_WND_LEN;
+	return (ctx->total * scale) >> AVER_WND_BITS;
 }
 
 /*
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "debug.h"
+
+/*
+ * Listen before talk backoff. The transmitter finding the channel busy
+ * defers the transmission by the random number of ticks. The backoff
+ * window is doubled on every deferral. After CCA_MAX_DEFERRALS the packet
+ * is sent regardless of the channel state so the latency is bounded.
+ * The code is shared with tools/cca_sim.
+ */
+
+// The initial backoff window is 1 << CCA_SLOT_BITS ticks. It should be
+// comparable with the packet airtime, see tools/cca_sim for the tradeoff.
+#ifndef CCA_SLOT_BITS
+#define CCA_SLOT_BITS 6
+#endif
+
+#ifndef CCA_MAX_DEFERRALS
+#define CCA_MAX_DEFERRALS 4
+#endif
+
+// The random bits are taken from the high bits of the generator state
+BUILD_BUG_ON(CCA_SLOT_BITS + CCA_MAX_DEFERRALS - 1 > 9);
+
+/* Update the random generator state. The noise is mixed in to decorrelate the transmitters. */
+static inline unsigned cca_rand(unsigned* seed, unsigned noise)
+{
+	// The mask makes the host simulation match 16 bit target
+	*seed = (*seed * 25173 + 13849 + noise) & 0xffff;
+	return *seed;
+}
+
+/* Returns the backoff in ticks given the number of deferrals so far */
+static inline unsigned cca_backoff(unsigned rnd, int deferrals)
+{
+	unsigned wnd = 1 << (CCA_SLOT_BITS + deferrals);
+	return 1 + ((rnd >> 7) & (wnd - 1));
+}
@@ -0,0 +1,276 @@
+/*
+ * CC430F5137 based photofinish - base station part
+ *
+ * The base station is receive only. It follows the session set up by the
+ * start and streams every packet heard on the working channel (on both
+ * channels in diversity mode) to the PC over UART at 115200 baud. The radio
+ * address filter is not used so the packets of all sessions are heard. Every packet is reported by the text line:
+ *
+ *   <time> <type>[*] <sn> <se> <err> <rssi> <lqi> [<data>]
+ *
+ * All fields are hex. The time is in msec since the base station power on,
+ * the '*' marks the packet with bad CRC. The rssi is the raw value from the
+ * radio status byte. The data depends on the packet type: the channel and
+ * flags for setup, the finish ID and slot for setup_resp, the finish ID
+ * for setup_ack, the offset in ticks for start, the time in msec for
+ * finish, the flags for status, the first run sequence number for sync,
+ * the frame index and count followed by the sn:time:err triples for batch,
+ * the frames mask for batch_ack.
+ *
+ * The UART commands:
+ *   d - dump trace
+ *   r - return to the control channel and wait the next setup
+ *   + - next channel
+ *   - - previous channel
+ */
+
+#include "io430.h"
+#include "common.h"
+#include "display.h"
+#include "utils.h"
+#include "rf_utils.h"
+#include "rf_buff.h"
+#include "wc.h"
+#include "uart.h"
+#include "sched.h"
+#include "trace.h"
+#include "session.h"
+
+static struct rf_buff g_rf;
+static struct wc_ctx  g_wc;
+static unsigned       g_rx_cnt;
+
+static const char* pkt_name(unsigned char type)
+{
+	switch (type) {
+	case pkt_setup:      return "setup";
+	case pkt_setup_resp: return "setup_resp";
+	case pkt_start:      return "start";
+	case pkt_finish:     return "finish";
+	case pkt_echo:       return "echo";
+	case pkt_resume:     return "resume";
+	case pkt_query:      return "query";
+	case pkt_sync:       return "sync";
+	case pkt_batch:      return "batch";
+	case pkt_batch_ack:  return "batch_ack";
+	case pkt_setup_ack:  return "setup_ack";
+	case pkt_ping:       return "ping";
+	case pkt_status:     return "status";
+	case pkt_reset:      return "reset";
+	}
+	return "?";
+}
+
+static unsigned long get_time(void)
+{
+	unsigned long ms;
+	__disable_interrupt();
+	ms = g_wc.ms;
+	__enable_interrupt();
+	return ms;
+}
+
+static void show_status(void)
+{
+	display_hex_(rfb_channel(&g_rf), 0, 2);
+	display_hex_(g_rx_cnt, 2, 2);
+	display_set_dp(1);
+}
+
+static void set_channel(unsigned char ch, unsigned char flags)
+{
+	rfb_cancel(&g_rf);
+	rfb_div_disable(&g_rf);
+	if (flags & SETUP_F_DIVERSITY)
+		rfb_div_enable(&g_rf, ch);
+	else
+		rf_set_channel(ch);
+	show_status();
+	rfb_listen(&g_rf);
+}
+
+static void forward(unsigned long ms)
+{
+	struct packet const* p = &g_rf.rx.p;
+	struct link_info const* li = &g_rf.rx.li;
+	int i;
+
+	uart_send_hex_(ms >> 16, 4);
+	uart_send_hex_(ms, 4);
+	uart_send_char(' ');
+	uart_send_str(pkt_name(p->type));
+	if (!li->crc_ok)
+		uart_send_char('*');
+	uart_send_char(' ');
+	uart_send_hex_(p->sn, 2);
+	uart_send_char(' ');
+	uart_send_hex_(p->se, 2);
+	uart_send_char(' ');
+	uart_send_hex_(p->err, 2);
+	uart_send_char(' ');
+	uart_send_hex_(li->rssi, 2);
+	uart_send_char(' ');
+	uart_send_hex_(li->lqi, 2);
+	switch (p->type) {
+	case pkt_setup:
+		uart_send_char(' ');
+		uart_send_hex_(p->setup.chan, 2);
+		uart_send_hex_(p->setup.flags, 2);
+		break;
+	case pkt_setup_resp:
+		uart_send_char(' ');
+		uart_send_hex_(p->setup_resp.id, 2);
+		uart_send_hex_(p->setup_resp.slot, 2);
+		break;
+	case pkt_setup_ack:
+		uart_send_char(' ');
+		uart_send_hex_(p->setup_ack.id, 2);
+		break;
+	case pkt_start:
+		uart_send_char(' ');
+		uart_send_hex_(p->start.offset, 4);
+		break;
+	case pkt_finish:
+		uart_send_char(' ');
+		uart_send_hex_(p->finish.time >> 16, 4);
+		uart_send_hex_(p->finish.time, 4);
+		break;
+	case pkt_status:
+		uart_send_char(' ');
+		uart_send_hex_(p->status.flags, 4);
+		break;
+	case pkt_sync:
+		uart_send_char(' ');
+		uart_send_hex_(p->sync.first_sn, 2);
+		break;
+	case pkt_batch:
+		uart_send_char(' ');
+		uart_send_hex_(p->batch.frame, 2);
+		uart_send_hex_(p->batch.frames, 2);
+		for (i = 0; i < p->batch.cnt && i < BATCH_RESULTS; ++i) {
+			struct run_result const* res = &p->batch.res[i];
+			uart_send_char(' ');
+			uart_send_hex_(res->sn, 2);
+			uart_send_char(':');
+			uart_send_hex_(res->time >> 16, 4);
+			uart_send_hex_(res->time, 4);
+			uart_send_char(':');
+			uart_send_hex_(res->err, 2);
+		}
+		break;
+	case pkt_batch_ack:
+		uart_send_char(' ');
+		uart_send_hex_(p->batch_ack.mask, 2);
+		break;
+	}
+	uart_send_char('\n');
+}
+
+// The packet received
+static void on_packet(void)
+{
+	struct packet const* p = &g_rf.rx.p;
+	// Timestamp the end of the packet reception
+	forward(get_time());
+	++g_rx_cnt;
+	show_status();
+	if (!g_rf.rx.li.crc_ok) {
+		trace(tr_rx_err, err_crc);
+		rfb_listen(&g_rf);
+		return;
+	}
+	trace(tr_rx, p->type);
+	switch (p->type) {
+	case pkt_setup:
+		if (p->setup.flags & SETUP_F_TEST)
+			break;
+		// Follow the start to the working channel
+		session_save(p->setup.chan, p->se, p->sn, p->setup.flags & SETUP_F_DIVERSITY, 0);
+		set_channel(p->setup.chan, p->setup.flags);
+		return;
+	case pkt_reset:
+		// The start is going to setup new session
+		session_clear();
+		set_channel(CTL_CHANNEL, 0);
+		return;
+	}
+	rfb_listen(&g_rf);
+}
+
+static void dispatch(unsigned ev)
+{
+	if (ev & ev_radio) {
+		if (rfb_complete(&g_rf) == rfb_listening)
+			on_packet();
+	}
+	if (ev & ev_uart) {
+		switch (uart_get_char()) {
+		case 'd':
+			trace_dump();
+			break;
+		case 'r':
+			set_channel(CTL_CHANNEL, 0);
+			break;
+		case '+':
+			set_channel(rfb_channel(&g_rf) + 1, 0);
+			break;
+		case '-':
+			set_channel(rfb_channel(&g_rf) - 1, 0);
+			break;
+		}
+	}
+}
+
+int main( void )
+{
+	struct nv_session const* sess;
+
+	stop_watchdog();
+	setup_ports();
+	setup_clock();
+	setup_uart_baud(UART_115200);
+	rf_init(sizeof(struct packet));
+	configure_timebase();
+	configure_watchdog();
+	trace_init(&g_wc.ticks);
+	__enable_interrupt();
+
+	// Show battery voltage on start
+	display_vcc();
+	sched_delay(SHORT_DELAY_TICKS);
+
+	// Resume the stored session unless the button is pressed
+	sess = session_load();
+	if (sess && (P1IN & BTN_BIT))
+		set_channel(sess->ch, sess->flags);
+	else
+		set_channel(CTL_CHANNEL, 0);
+
+	sched_clear(ev_uart);
+	for (;;)
+		dispatch(sched_wait(~0));
+}
+
+// The system tick
+#pragma vector=TIMER1_A0_VECTOR
+__interrupt void TIMER1_A0_ISR(void)
+{
+	timebase_next_tick();
+	wc_update(&g_wc);
+	if (sched_tick())
+		__low_power_mode_off_on_exit();
+}
+
+// The UI slot
+#pragma vector=TIMER1_A1_VECTOR
+__interrupt void TIMER1_A1_ISR(void)
+{
+	switch (__even_in_range(TA1IV, 14)) {
+	case 2:
+		timebase_next_slot();
+		if (sched_is_alive())
+			watchdog_kick();
+		display_refresh();
+		break;
+	}
+}
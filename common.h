@@ -2,9 +2,19 @@
 
 //#define SILENT
 
+// Uncomment to use synchronous photo detector instead of the IR receiver module at the finish
+//#define IR_PHOTOSYNC
+
+// Uncomment to collect the interrupt handlers execution time statistics (finish only)
+//#define ISR_PROFILE
+
+// Uncomment to disable the events trace
+//#define NO_TRACE
+
 #define LED_BIT       BIT0       // On-board LED (P1)
 #define RX_BIT        BIT0       // IR Receiver  (P2)
 #define IR_BITS      (BIT5|BIT6) // IR LEDs      (P1)
+#define IR_PWM_BIT    BIT5       // IR LED driven by the carrier timer output (P1)
 #define BTN_BIT       BIT4       // User button  (P1)
 #define START_BTN_BIT BIT3       // Start button (P1)
 #define PING_BTN      BIT1       // Ping button (P1)
@@ -12,6 +22,7 @@
 #define CALIB_SW      BIT4       // IR calibration switch (P1)
 #define BATT_SENSE    BIT2       // battery sense input (P2)
 #define XSTATUS       BIT4       // auxiliary status input (P2)
+#define UART_RX_BIT   BIT7       // UART commands input (P2)
 
 #ifndef SILENT
 // Beeper (P1)
@@ -22,10 +33,15 @@
 
 #define IR_BURST_PULSES 16
 
-#define REPEAT_MSGS 2
-#define REPEAT_MSGS_DELAY 4
+/* IR carrier period in SMCLK cycles (6.5MHz / 38kHz) */
+#define IR_CARRIER_PERIOD 171
+
+/* The system tick rate generated by TA1 (1 msec) */
+#define TICK_HZ 1000
+/* The tick period in SMCLK cycles (26MHz / 4 / TICK_HZ) */
+#define TICK_CYCLES 6500
 
-#define SHORT_DELAY_TICKS 500
+#define REPEAT_MSGS 2
+#define REPEAT_MSGS_DELAY 5
 
-/* We are expecting 793.5 Hz watchdog interrupt rate (26MHz / (4*8192)) */
-#define WD_HZ  793
+#define SHORT_DELAY_TICKS 630
@@ -55,6 +55,7 @@ static unsigned char disp_char_map[] = {
 	['O'] = _a_|_b_|_c_|_d_|_e_|_f_,
 	['o'] = _c_|_d_|_e_|_g_,
 	['t'] = _f_|_e_|_d_|_g_,
+	['y'] = _b_|_c_|_d_|_f_|_g_,
 	['?'] = _a_|_b_|_g_|_e_,
 	['`'] = _f_|_g_,
 };
@@ -147,3 +148,36 @@ void display_dec(unsigned val)
 	}
 }
 
+void display_time_digits(const unsigned char* d)
+{
+	if (!d[4] && !d[5]) {
+		// ss.hh
+		display_bin(d);
+		display_set_dp(1);
+	} else if (!d[5]) {
+		// m.ss.h
+		display_bin(d + 1);
+		display_set_dp_mask((1 << 0) | (1 << 2));
+	} else {
+		// mm.ss
+		display_bin(d + 2);
+		display_set_dp(1);
+	}
+}
+
+void display_time(unsigned long ms)
+{
+	unsigned char d[6];
+	unsigned long cs = ms / 10;
+	unsigned s, m;
+	d[0] = cs % 10;
+	d[1] = (cs / 10) % 10;
+	s = cs / 100 % 6000;
+	m = s / 60;
+	s -= m * 60;
+	d[2] = s % 10;
+	d[3] = s / 10;
+	d[4] = m % 10;
+	d[5] = m / 10;
+	display_time_digits(d);
+}
@@ -44,6 +44,15 @@ static inline void display_hex(unsigned val)
 	display_hex_(val, 0, DISP_SEGS);
 }
 
+/*
+ * Display time given by BCD digits (1/100 sec, 1/10 sec, sec, 10 sec, min, 10 min)
+ * as ss.hh, m.ss.h or mm.ss depending on its value.
+ */
+void display_time_digits(const unsigned char* d);
+
+/* Display time in msec */
+void display_time(unsigned long ms);
+
 static inline void display_vcc()
 {
 	display_set_dp(0);
@@ -10,6 +10,51 @@
 #include "rf_buff.h"
 #include "wc.h"
 #include "uart.h"
+#include "sched.h"
+#include "isr_prof.h"
+#include "trace.h"
+#include "session.h"
+#ifdef IR_PHOTOSYNC
+#include "photosync.h"
+#else
+#include "vcc.h"
+#endif
+
+// Burst timestamp: the wall clock time in msec and the preceding burst period in ticks
+struct ir_ts {
+	unsigned long time;
+	unsigned period;
+};
+
+#define IRF_TS_T struct ir_ts
+#include "ir_filter.h"
+
+// The finish is detected when IR_FILTER_K of the last IR_FILTER_M bursts are broken
+#define IR_FILTER_K 2
+#define IR_FILTER_M 3
+
+/*
+ * IR burst scheduler tunables (bursts per second). The IR LED is lit for
+ * half of the burst (IR_BURST_PULSES carrier periods, ~420us) so every
+ * 100 bursts/sec cost ~2% of the LED pulse current on average. The crossing
+ * detection latency is bounded by the burst period.
+ */
+#define IR_RATE_FAST  TICK_HZ // Finish window, latency <= 1ms, ~21% LED duty
+#define IR_RATE_ARMED 200     // Started but finish is not expected yet, latency <= 5ms
+#define IR_RATE_SETUP 80      // Setup and calibration
+#define IR_RATE_IDLE  1       // Stopped, barrier health monitoring only
+
+// The photo detector is sampled at the fixed rate in all active states
+#define IR_RATE_PHS   100
+
+#define IR_DIV(rate) (TICK_HZ / (rate))
+
+// The finish window opens at this fraction (in 1/16 units) of the previous run time
+#define IR_WINDOW_FRACTION 12
+
+// The number of the last results kept to answer the start queries.
+// All of them may be sent by the single window of pkt_batch frames.
+#define RESULT_CACHE_LEN (BATCH_WINDOW * BATCH_RESULTS)
 
 static struct rf_buff g_rf;
 static struct wc_ctx  g_wc;
@@ -20,16 +65,51 @@ typedef enum {
 	st_setup,
 	st_started,
 	st_stopped,
+	st_ping_reply, // Stopped, replying to the ping from the start
+	st_ping,       // Stopped, waiting the start response to ping
 } state_t;
 
+// Application events
+enum {
+	ev_finish  = ev_app,      // Finish detected or timeout
+	ev_no_ir   = ev_app << 1, // IR barrier is broken
+	ev_ir_good = ev_app << 2, // IR barrier was not broken for NO_IR_EXPIRE_TICKS
+	ev_ir_cap  = ev_app << 3, // IR capture data is ready
+	ev_btn     = ev_app << 4, // Ping button pressed
+	ev_timer   = ev_app << 5, // The state timer expired
+};
+
+#define BTN_DEBOUNCE_TICKS 80
+#define NO_IR_EXPIRE_TICKS (10 * TICK_HZ)
+
 static state_t  g_state;
 static int      g_timeout;
 static int      g_ir_timer;
-static int      g_ir_burst;
+static volatile int g_ir_div;
+static unsigned g_ir_burst_ticks;
+static struct ir_ts g_ir_burst_ts;
+static struct ir_ts g_finish_ts;
+static int      g_finished;
+static struct irf_ctx g_irf;
+static unsigned g_ir_cap_bits;
+static unsigned g_ir_cap_byte;
+static int      g_ir_cap_cnt;
+static volatile int g_ir_cap_ready;
+static unsigned long g_ir_window;
+static unsigned char g_run_sn;
+static struct run_result g_results[RESULT_CACHE_LEN];
+static unsigned      g_results_cnt;
 static int      g_no_ir;
-static unsigned g_no_ir_gen;
-static unsigned g_start_gen;
+static int      g_no_ir_reported;
+static int      g_low_batt_reported;
 static int      g_beep;
+static unsigned g_btn_pressed;
+static volatile int g_clock_updated;
+#ifdef IR_PHOTOSYNC
+static struct phs_ctx g_phs;
+static struct ir_ts   g_phs_ts;
+static volatile int   g_phs_pending;
+#endif
 
 static int is_calibrating(void)
 {
@@ -51,27 +131,115 @@ static inline void beep_off(void)
 	g_beep = 0;
 }
 
-// Timer0 A0 interrupt service routine
-#pragma vector=TIMER0_A0_VECTOR
-__interrupt void TIMER0_A0_ISR(void)
+// Streaming raw IR data to UART for offline tuning
+static int ir_capturing(void)
+{
+	return is_calibrating() && (P2IN & XSTATUS);
+}
+
+// Process the result of the IR burst or photo detector run. Returns 1 on finish.
+static int ir_burst_done(int broken, struct ir_ts const* ts)
+{
+	if (broken)
+		g_no_ir = 1;
+	if (g_state == st_started && !g_finished && irf_put(&g_irf, broken, *ts)) {
+		// Report the time of the first broken burst
+		g_finish_ts = irf_first_ts(&g_irf);
+		g_finished = 1;
+		sched_post(ev_finish);
+		return 1;
+	}
+	return 0;
+}
+
+#ifndef IR_PHOTOSYNC
+
+// Called from TIMER1_A1 ISR on the burst end. Returns 1 if events are posted.
+static inline int ir_burst_end(void)
+{
+	int broken, posted;
+	ir_burst_stop();
+	broken = (P2IN & RX_BIT) != 0;
+	posted = ir_burst_done(broken, &g_ir_burst_ts);
+	if (ir_capturing()) {
+		// Capture burst trace for the offline filter tuning
+		g_ir_cap_bits = (g_ir_cap_bits << 1) | broken;
+		if (++g_ir_cap_cnt >= 8) {
+			g_ir_cap_byte = g_ir_cap_bits;
+			g_ir_cap_cnt = 0;
+			g_ir_cap_ready = 1;
+			sched_post(ev_ir_cap);
+			posted = 1;
+		}
+	}
+	return posted;
+}
+
+// Returns 1 if the burst is started
+static inline int ir_sched(void)
+{
+	ir_burst_start();
+	return 1;
+}
+
+static inline void ir_poll(void)
+{
+}
+
+static inline void ir_init(void)
+{
+	configure_timer_38k();
+	timer_38k_enable(1);
+}
+
+#else
+
+// Returns 1 if the acquisition is started
+static inline int ir_sched(void)
+{
+	// Start acquisition unless the previous run is not processed yet
+	if (g_phs_pending)
+		return 0;
+	g_phs_pending = 1;
+	phs_start(&g_phs);
+	return 1;
+}
+
+// Process photo detector run if completed. Called on ev_acquired.
+static void ir_poll(void)
 {
-	// IR burst generation
-	if (!g_ir_burst)
+	struct ir_ts ts;
+	if (!g_phs_pending || !phs_poll(&g_phs))
 		return;
-	--g_ir_burst;
-	if (g_ir_burst & 1)
-		P1OUT |= IR_BITS;
-	else
-		P1OUT &= ~IR_BITS;
-	if (!g_ir_burst) {
-		/* Last pulse in burst ended */
-		if (P2IN & RX_BIT)
-			g_no_ir = 1;
+	ts = g_phs_ts;
+	if (g_phs.detected_cnt)
+		// Stamp the interpolated crossing instead of the run start (the tick is 1 msec)
+		ts.time = phs_crossing_time(&g_phs, ts.time, ts.period);
+	ir_burst_done(g_phs.detected_cnt || g_phs.overload, &ts);
+	g_phs_pending = 0;
+	if (ir_capturing()) {
+		// Stream raw run data for the offline replay. The stream takes ~83% of the
+		// UART bandwidth so it is queued without waiting and the record is dropped on overflow.
+		unsigned char rec[PHS_REC_SZ];
+		phs_record(&g_phs, rec);
+		uart_try_send_buff(rec, PHS_REC_SZ);
 	}
+	if (g_phs.detected)
+		// Rearm detector, the confirmation is up to the finish filter
+		phs_set_mode(&g_phs, 1, 1);
 }
 
+static inline void ir_init(void)
+{
+	phs_init(&g_phs);
+	phs_set_mode(&g_phs, 1, 1);
+}
+
+#endif
+
 static void set_state(state_t st)
 {
+	trace(tr_state, st);
 	g_state = st;
 }
 
@@ -79,26 +247,74 @@ static int ir_divider(void)
 {
 	if (g_state == st_idle)
 		return 0;
+#ifdef IR_PHOTOSYNC
+	return IR_DIV(IR_RATE_PHS);
+#else
 	if (g_state == st_started)
-		return 1;
+		return g_wc.ms >= g_ir_window ? IR_DIV(IR_RATE_FAST) : IR_DIV(IR_RATE_ARMED);
 	if (g_state == st_setup || is_calibrating())
-		return 10;
-	return WD_HZ;
+		return IR_DIV(IR_RATE_SETUP);
+	return IR_DIV(IR_RATE_IDLE);
+#endif
 }
 
-#pragma vector=WDT_VECTOR
-__interrupt void watchdog_timer(void)
+/*
+ * The system tick. It is doing timekeeping only so its execution time
+ * does not depend on the state. The IR schedule goes first so the burst
+ * is started at the fixed latency after the tick. The rest is up to the
+ * UI slot and the main loop.
+ */
+#pragma vector=TIMER1_A0_VECTOR
+__interrupt void TIMER1_A0_ISR(void)
 {
-	// Routine maintenance tasks
-	int ir_div = ir_divider();
-	int r = wc_update(&g_wc);
-	if (r && g_state == st_started) {
-		display_set_dp(1);
-		display_bin(g_wc.d);
-		if (r > WC_DIGITS)
-			g_timeout = 1;
+	int ir_div = g_ir_div;
+	int ir_started = 0;
+	int r;
+	ISR_PROF_BEGIN();
+	timebase_next_tick();
+	if (ir_div && ++g_ir_timer >= ir_div) {
+		g_ir_timer = 0;
+		ir_started = ir_sched();
+	}
+	r = wc_update(&g_wc);
+	if (g_state == st_started) {
+		if (r) {
+			g_clock_updated = 1;
+			if (r > WC_DIGITS) {
+				g_timeout = 1;
+				sched_post(ev_finish);
+			}
+		}
+	}
+	if (ir_started) {
+		g_ir_burst_ts.time = g_wc.ms;
+		g_ir_burst_ts.period = g_wc.ticks - g_ir_burst_ticks;
+		g_ir_burst_ticks = g_wc.ticks;
+#ifdef IR_PHOTOSYNC
+		g_phs_ts = g_ir_burst_ts;
+#endif
+	}
+	if (sched_tick())
+		__low_power_mode_off_on_exit();
+	ISR_PROF_END(prof_tick);
+}
+
+// Routine maintenance tasks in the UI slot. Returns 1 if events are posted.
+static int ui_slot(void)
+{
+	unsigned ev = 0;
+	if (sched_is_alive())
+		watchdog_kick();
+	g_ir_div = ir_divider();
+	if (g_clock_updated) {
+		g_clock_updated = 0;
+		display_time_digits(g_wc.d);
 	}
 	display_refresh();
+#ifndef IR_PHOTOSYNC
+	// The photo detector is using the ADC in IR_PHOTOSYNC build
+	vcc_slot();
+#endif
 	if (is_calibrating()) {
 		P1OUT |= CALIB_LED;
 	} else {
@@ -106,9 +322,9 @@ __interrupt void watchdog_timer(void)
 	}
 	if (g_no_ir) {
 		g_no_ir = 0;
-		++g_no_ir_gen;
+		ev |= ev_no_ir;
 		if (is_calibrating())
-			beep(ir_div * 2);
+			beep(g_ir_div * 2);
 	}
 	if (g_beep) {
 		if (g_beep > 0)
@@ -117,19 +333,45 @@ __interrupt void watchdog_timer(void)
 	} else {
 		P1OUT &= ~BEEP_BIT;
 	}
-	if (ir_div) {
-		if (++g_ir_timer >= ir_div) {
-			g_ir_timer -= ir_div;
-			g_ir_burst = IR_BURST_PULSES * 2;
-		}
+	if (!(P1IN & PING_BTN)) {
+		if (!g_btn_pressed)
+			ev |= ev_btn;
+		g_btn_pressed = BTN_DEBOUNCE_TICKS;
+	} else if (g_btn_pressed) {
+		--g_btn_pressed;
+	}
+	sched_post(ev);
+	return ev != 0;
+}
+
+#pragma vector=TIMER1_A1_VECTOR
+__interrupt void TIMER1_A1_ISR(void)
+{
+	ISR_PROF_BEGIN();
+	switch (__even_in_range(TA1IV, 14)) {
+	case 2:
+		timebase_next_slot();
+		if (ui_slot())
+			__low_power_mode_off_on_exit();
+		ISR_PROF_END(prof_ui);
+		break;
+#ifndef IR_PHOTOSYNC
+	case 4:
+		// IR burst ended
+		if (ir_burst_end())
+			__low_power_mode_off_on_exit();
+		ISR_PROF_END(prof_burst);
+		break;
+#endif
 	}
-	__low_power_mode_off_on_exit();
 }
 
 // Setup working channel
 static void setup_channel(void)
 {
 	int r;
+	unsigned ts, elapsed;
+	unsigned char chan, flags, sn, slot, id;
 
 	set_state(st_setup);
 
@@ -142,7 +384,7 @@ static void setup_channel(void)
 		// Show error message
 		rfb_err_msg(r);
 		// Reset itself
-		wc_delay(&g_wc, SHORT_DELAY_TICKS);
+		sched_delay(SHORT_DELAY_TICKS);
 		reset();
 	} else {
 		// Show channel number
@@ -150,196 +392,416 @@ static void setup_channel(void)
 		display_set_dp(1);
 		display_hex_(g_rf.rx.p.setup.chan, 2, 2);
 	}
+	chan  = g_rf.rx.p.setup.chan;
+	flags = g_rf.rx.p.setup.flags;
+	sn    = g_rf.rx.p.sn;
 
 	beep_on();
 
-	// Set working channel
-	rf_set_channel(g_rf.rx.p.setup.chan);
+	// Set working channel accepting the packets of this session only
+	rf_set_channel(chan);
+	rfb_set_session(&g_rf, g_rf.tx.se);
 
-	// Delay to allow sender to switch to RX
-	wc_delay(&g_wc, SETUP_RESP_DELAY);
+	// Delay to allow sender to switch to RX. The other finishes may be
+	// answering the same setup so the response slot is random.
+	slot = (rfb_rand(&g_rf) >> 7) % SETUP_SLOTS;
+	id   = rfb_rand(&g_rf) >> 8;
+	sched_delay(SETUP_RESP_DELAY + slot * SETUP_SLOT_TICKS);
 
 	// Send test message
-	g_rf.tx.setup_resp.li = g_rf.rx.li;
+	g_rf.tx.setup_resp.id   = id;
+	g_rf.tx.setup_resp.slot = slot;
 	rfb_send_msg(&g_rf, pkt_setup_resp);
 
 	beep_off();
 
 	// Reset itself on error or in test mode
-	if (r || (g_rf.rx.p.setup.flags & SETUP_F_TEST))
+	if (r || (flags & SETUP_F_TEST))
+		reset();
+
+	// Wait for the start to confirm this finish is chosen. The other
+	// finishes' responses share the session so they are skipped.
+	ts = g_wc.ticks;
+	r = -1;
+	while ((elapsed = g_wc.ticks - ts) < SETUP_ACK_TIMEOUT) {
+		r = rfb_receive_msg_tout(&g_rf, pkt_setup_ack, SETUP_ACK_TIMEOUT - elapsed);
+		if (r <= 0)
+			break;
+	}
+	if (r || g_rf.rx.p.setup_ack.id != id) {
+		// Return to the control channel
+		display_msg("----");
+		sched_delay(SHORT_DELAY_TICKS);
 		reset();
+	}
+
+	if (flags & SETUP_F_DIVERSITY)
+		rfb_div_enable(&g_rf, chan);
+
+	// Remember the session to be able to resume it after reboot
+	session_save(chan, g_rf.tx.se, sn, flags & SETUP_F_DIVERSITY, 0);
 }
 
 /*
- * IR barrier health monitoring stuff
+ * Resume the session stored in nvram. The start will verify it by
+ * pkt_resume exchange. Returns 0 if there is no valid session or
+ * the ping button is pressed forcing the full setup.
  */
-static unsigned g_no_ir_gen_;
-static unsigned g_no_ir_expire;
-static int      g_no_ir_reported;
+static int resume_session(void)
+{
+	struct nv_session const* s = session_load();
+	if (!s || !(P1IN & PING_BTN))
+		return 0;
+	rfb_set_session(&g_rf, s->se);
+	if (s->flags & SETUP_F_DIVERSITY)
+		rfb_div_enable(&g_rf, s->ch);
+	else
+		rf_set_channel(s->ch);
+	display_msg("Ch");
+	display_set_dp(1);
+	display_hex_(s->ch, 2, 2);
+	return 1;
+}
 
-static void chk_ir_ctx_init(void)
+static void set_listening_state(state_t st)
 {
-	g_no_ir_gen_   = g_no_ir_gen;
-	g_no_ir_expire = g_wc.ticks + 10 * WD_HZ;
+	set_state(st);
+	rfb_listen(&g_rf);
 }
 
-enum {
-	ir_event     = -1,
-	btn_event    = -2,
-	finish_event = -3
-};
+static int is_stopped(void)
+{
+	return g_state == st_stopped || g_state == st_ping_reply || g_state == st_ping;
+}
 
-static int monitor_btn(void)
+// Send status to start and continue listening
+static void send_status(void)
 {
-	if (!(P1IN & PING_BTN)) {
-		return btn_event;
-	}
-	return 0;
+	g_rf.tx.status.flags = 0;
+	if (g_no_ir_reported)
+		g_rf.tx.status.flags |= sta_no_ir;
+	if (g_low_batt_reported)
+		g_rf.tx.status.flags |= sta_low_batt;
+	rfb_cancel(&g_rf);
+	rfb_send_msg(&g_rf, pkt_status);
+	rfb_listen(&g_rf);
 }
 
-static int monitor_ir(void)
+/*
+ * IR barrier health monitoring. The start is alerted as soon as the barrier
+ * is broken while the good status is sent after NO_IR_EXPIRE_TICKS since the
+ * barrier was broken last time.
+ */
+static void monitor_ir(unsigned ev)
 {
-	if (g_no_ir_gen_ != g_no_ir_gen) {
-		if (!g_no_ir_reported)
-			return ir_event;
-		chk_ir_ctx_init();
+	if (ev & ev_no_ir) {
+		sched_timer_start(ev_ir_good, NO_IR_EXPIRE_TICKS);
+		if (g_no_ir_reported)
+			return;
+		trace(tr_no_ir, 0);
+		display_msg("noIr");
+		g_no_ir_reported = 1;
 	} else {
-		if (g_no_ir_reported && (int)(g_wc.ticks - g_no_ir_expire) > 0)
-			return ir_event;
+		if (!g_no_ir_reported)
+			return;
+		trace(tr_ir_good, 0);
+		display_msg("Good");
+		g_no_ir_reported = 0;
 	}
-	return 0;
+	send_status();
 }
 
-static int monitor_events(void)
+#ifndef IR_PHOTOSYNC
+/*
+ * Battery monitoring. Called on ev_vcc while stopped. The flash log is
+ * written here since the flash programming stalls the CPU.
+ */
+static void monitor_vcc(void)
 {
-	int e;
-	if ((e = monitor_ir()))
-		return e;
-	if ((e = monitor_btn()))
-		return e;
-	return 0;
+	vcc_log();
+	if (vcc_low() == g_low_batt_reported)
+		return;
+	g_low_batt_reported = vcc_low();
+	if (g_low_batt_reported)
+		display_msg("bAtt");
+	send_status();
 }
+#endif
 
-static int monitor_finish(void)
+static void ir_capture_flush(void)
 {
-	if (g_timeout)
-		return finish_event;
-	if (g_start_gen != g_no_ir_gen)
-		return finish_event;
-	return 0;
+	if (g_ir_cap_ready) {
+		g_ir_cap_ready = 0;
+		uart_send_bits(g_ir_cap_byte, 8);
+	}
 }
 
-static void wait_start(void)
-{
-	for (;;) {
-		int r;
-		// Wait start message monitoring IR at the same time
-		chk_ir_ctx_init();
-		if (!(r = rfb_receive_valid_msg_(&g_rf, -1, monitor_events))) {
-			switch (g_rf.rx.p.type) {
-			case pkt_start:
-				// Start message received
-				g_timeout = 0;
-				wc_reset(&g_wc);
-				wc_advance(&g_wc, g_rf.rx.p.start.offset);
-				return;
-			case pkt_ping:
-				// Ping message received
-				beep_on();
-				display_rssi();
-				wc_delay(&g_wc, SHORT_DELAY_TICKS);
-				rfb_send_msg(&g_rf, pkt_ping);
-				beep_off();
-				break;
-			case pkt_reset:
-				// Start wants to reinitialize communication
-				reset();
-			}
-			continue;
-		}
-		if (r == ir_event) {
-			// Need to send IR status to start
-			if (!g_no_ir_reported) {
-				display_msg("noIr");
-				g_rf.tx.status.flags = sta_no_ir;
-				rfb_send_msg(&g_rf, pkt_status);
-				g_no_ir_reported = 1;
-			} else {
-				display_msg("Good");
-				g_rf.tx.status.flags = 0;
-				rfb_send_msg(&g_rf, pkt_status);
-				g_no_ir_reported = 0;
-			}
-			continue;
-		}
-		if (r == btn_event)
-		{
-			// Send ping to start
-			for (;;) {
-				wait_btn_release();
-				beep_on();
-				display_msg("PIng");
-				rfb_send_msg(&g_rf, pkt_ping);
-				r = rfb_receive_valid_msg_(&g_rf, pkt_ping, monitor_btn);
-				if (!r) {
-					display_rssi();
-					beep_off();
-					break;
-				}
-				if (r == btn_event) {
-					beep_off();
-					continue;
-				}
-				rfb_err_msg(r);
-				break;
-			}
-			continue;
+static void start_run(void)
+{
+	trace(tr_start, trace_sat(g_rf.rx.p.start.offset));
+	g_run_sn = g_rf.rx.p.sn;
+	g_timeout = 0;
+	wc_reset(&g_wc);
+	wc_advance(&g_wc, g_rf.rx.p.start.offset);
+	irf_reset(&g_irf);
+	g_finished = 0;
+	sched_clear(ev_finish);
+	sched_timer_stop(ev_timer);
+	beep(SHORT_DELAY_TICKS);
+	set_state(st_started);
+}
+
+static void send_ping(void)
+{
+	rfb_cancel(&g_rf);
+	beep_on();
+	display_msg("PIng");
+	rfb_send_msg(&g_rf, pkt_ping);
+	set_listening_state(st_ping);
+}
+
+static void send_result(struct run_result const* res)
+{
+	unsigned char type = pkt_finish;
+	g_rf.tx.err |= res->err;
+	g_rf.tx.finish.time = res->time;
+	// The time over 65 sec does not fit the short packet
+	if (res->time >> 16)
+		type |= pkt_ext;
+	rfb_send_msg(&g_rf, type);
+}
+
+// Answer the start query for the result of the run with the given sequence number
+static void answer_query(unsigned char sn)
+{
+	unsigned i, n = g_results_cnt < RESULT_CACHE_LEN ? g_results_cnt : RESULT_CACHE_LEN;
+	// Search from the latest result
+	for (i = 1; i <= n; ++i) {
+		struct run_result const* res = &g_results[(g_results_cnt - i) % RESULT_CACHE_LEN];
+		if (res->sn == sn) {
+			send_result(res);
+			return;
 		}
-		rfb_err_msg(r);
 	}
+	// The run is not finished yet or too old, let the start try again later
 }
 
-static void detect_finish(void)
+/*
+ * Send the cached results of the runs starting from the given sequence number
+ * (oldest first) by the window of pkt_batch frames. The frames missing in the
+ * start acknowledgement are sent again up to BATCH_TRIES times.
+ */
+static void send_batch(unsigned char first_sn)
 {
-	g_start_gen = g_no_ir_gen;
-	for (;;) {
-		if (!rfb_receive_valid_msg_(&g_rf, -1, monitor_finish)) {
-			if (g_rf.rx.p.type == pkt_reset) {
-				// Start wants to reinitialize communication
-				reset();
-			}
-			// Ignore all other packets till finish
-		} else {
-			// Finished
-			return;
+	static struct run_result const* sel[RESULT_CACHE_LEN];
+	unsigned i, n = 0, cnt = g_results_cnt < RESULT_CACHE_LEN ? g_results_cnt : RESULT_CACHE_LEN;
+	unsigned char f, frames, all, acked = 0, sn = g_rf.rx.p.sn;
+	int tries;
+
+	for (i = cnt; i; --i) {
+		struct run_result const* res = &g_results[(g_results_cnt - i) % RESULT_CACHE_LEN];
+		if ((unsigned char)(res->sn - first_sn) < 0x80)
+			sel[n++] = res;
+	}
+	// The empty frame is sent if there are no results
+	frames = n ? (n + BATCH_RESULTS - 1) / BATCH_RESULTS : 1;
+	all = (1 << frames) - 1;
+
+	for (tries = BATCH_TRIES; tries && acked != all; --tries) {
+		// The frames are answering the sync request even if the damaged packet was received since
+		g_rf.rx.p.sn = sn;
+		for (f = 0; f < frames; ++f) {
+			unsigned first = f * BATCH_RESULTS;
+			if (acked & (1 << f))
+				continue;
+			g_rf.tx.batch.frame  = f;
+			g_rf.tx.batch.frames = frames;
+			g_rf.tx.batch.cnt    = n - first < BATCH_RESULTS ? n - first : BATCH_RESULTS;
+			for (i = 0; i < g_rf.tx.batch.cnt; ++i)
+				g_rf.tx.batch.res[i] = *sel[first + i];
+			rfb_send_msg(&g_rf, pkt_batch);
+			sched_delay(REPEAT_MSGS_DELAY);
 		}
+		if (!rfb_receive_msg_tout(&g_rf, pkt_batch_ack, BATCH_ACK_TIMEOUT))
+			acked |= g_rf.rx.p.batch_ack.mask;
+		if (acked != all)
+			// The frames or the acknowledgement are lost
+			rfb_power_up(&g_rf);
 	}
 }
 
 static void report_finish(void)
 {
 	int i;
+	struct run_result* res = &g_results[g_results_cnt++ % RESULT_CACHE_LEN];
 
 	beep_on();
 
+	res->sn = g_run_sn;
 	if (g_timeout) {
 		display_msg("----");
-		g_rf.tx.err |= err_timeout;
-		g_rf.tx.finish.time = 0;
-	} else
-		g_rf.tx.finish.time = wc_get_time(&g_wc);
-
-	display_hex(g_rf.tx.finish.time);
+		res->err = err_timeout;
+		res->time = 0;
+		g_ir_window = 0;
+	} else {
+		res->err = 0;
+		res->time = g_finish_ts.time;
+		// Expect the next finish around the same time
+		g_ir_window = (g_finish_ts.time >> 4) * IR_WINDOW_FRACTION;
+		display_time(g_finish_ts.time);
+	}
 
-	for (i = REPEAT_MSGS; i; --i) {
-		rfb_send_msg(&g_rf, pkt_finish);
-		wc_delay(&g_wc, REPEAT_MSGS_DELAY);
+	for (i = 0; i < REPEAT_MSGS; ++i) {
+		// Alternate channels in diversity mode
+		rfb_div_select(&g_rf, i);
+		send_result(res);
+		sched_delay(REPEAT_MSGS_DELAY);
 	}
 
 	beep_off();
 
 	if (P2IN & XSTATUS) {
 		uart_send_time_hex(g_rf.tx.finish.time);
+		// The time uncertainty in ticks
+		uart_send_hex('l', g_finish_ts.period);
+		// The packets deferred due to busy channel
+		uart_send_hex('b', g_rf.cca_deferrals);
+		isr_prof_report();
+	}
+}
+
+// The packet received
+static void on_packet(void)
+{
+	int r = rfb_chk_rx_err(&g_rf, g_state == st_ping ? pkt_ping : -1);
+	if (r == err_crc) {
+		// Ignore damaged packet
+		rfb_listen(&g_rf);
+		return;
+	}
+	if (!r && g_rf.rx.p.type == pkt_reset) {
+		// Start wants to reinitialize communication
+		session_clear();
+		reset();
+	}
+	if (!r && g_rf.rx.p.type == pkt_query) {
+		// The start has missed the result, may be received in any state
+		rfb_power_up(&g_rf);
+		answer_query(g_rf.rx.p.sn);
+		rfb_listen(&g_rf);
+		return;
+	}
+	switch (g_state) {
+	case st_stopped:
+		if (r) {
+			rfb_err_msg(r);
+			break;
+		}
+		switch (g_rf.rx.p.type) {
+		case pkt_start:
+			// Start message received
+			start_run();
+			break;
+		case pkt_echo:
+			// Link test, reply immediately
+			rfb_send_msg(&g_rf, pkt_echo);
+			break;
+		case pkt_resume:
+			// The start is rebooted and verifies the session
+			rfb_send_msg(&g_rf, pkt_resume);
+			beep(SHORT_DELAY_TICKS);
+			break;
+		case pkt_sync:
+			// The start is catching up the results
+			send_batch(g_rf.rx.p.sync.first_sn);
+			break;
+		case pkt_ping:
+			// Ping message received, reply after delay
+			beep_on();
+			display_rssi();
+			set_state(st_ping_reply);
+			sched_timer_start(ev_timer, SHORT_DELAY_TICKS);
+			return;
+		}
+		break;
+	case st_ping:
+		// Ping response received
+		beep_off();
+		if (r)
+			rfb_err_msg(r);
+		else
+			display_rssi();
+		set_state(st_stopped);
+		break;
+	default:
+		// Ignore all other packets till finish
+		break;
+	}
+	rfb_listen(&g_rf);
+}
+
+static void dispatch(unsigned ev)
+{
+	if (ev & ev_acquired)
+		ir_poll();
+	if (ev & ev_ir_cap)
+		ir_capture_flush();
+	if (ev & ev_radio) {
+		if (rfb_complete(&g_rf) == rfb_listening)
+			on_packet();
+	}
+	if (ev & ev_finish) {
+		if (g_state == st_started && (g_finished || g_timeout)) {
+			// Finished
+			if (g_timeout)
+				trace(tr_timeout, 0);
+			else
+				trace(tr_finish, trace_sat(g_finish_ts.period));
+			rfb_cancel(&g_rf);
+			set_state(st_stopped);
+			report_finish();
+			// The radio is idle, follow the temperature drift
+			rfb_div_calibrate(&g_rf);
+			if (g_no_ir_reported)
+				sched_timer_start(ev_ir_good, NO_IR_EXPIRE_TICKS);
+			rfb_listen(&g_rf);
+		}
+	}
+	if (ev & ev_timer) {
+		if (g_state == st_ping_reply) {
+			rfb_send_msg(&g_rf, pkt_ping);
+			beep_off();
+			set_listening_state(st_stopped);
+		}
+	}
+	if (ev & (ev_no_ir|ev_ir_good)) {
+		if (is_stopped())
+			monitor_ir(ev);
+	}
+#ifndef IR_PHOTOSYNC
+	if (ev & ev_vcc) {
+		vcc_process();
+		if (is_stopped())
+			monitor_vcc();
+	}
+#endif
+	if (ev & ev_uart) {
+		switch (uart_get_char()) {
+		case 'd':
+			trace_dump();
+			break;
+#ifndef IR_PHOTOSYNC
+		case 'v':
+			vcc_report();
+			break;
+#endif
+		}
+	}
+	if (ev & ev_btn) {
+		// Send ping to start
+		trace(tr_btn, 3);
+		if (g_state == st_stopped || g_state == st_ping)
+			send_ping();
 	}
 }
 
@@ -360,28 +822,31 @@ int main( void )
 	setup_clock();
 	setup_uart();
 	rf_init(sizeof(struct packet));
-	configure_timer_38k();
-	timer_38k_enable(1);
+	configure_timebase();
 	configure_watchdog();
+	trace_init(&g_wc.ticks);
+	irf_init(&g_irf, IR_FILTER_K, IR_FILTER_M);
 
 	__enable_interrupt();
 
 	// Show battery voltage on start
 	display_vcc();
+#ifndef IR_PHOTOSYNC
+	vcc_init();
+#endif
+
+	// Start IR barrier after the battery measurement since they share ADC
+	ir_init();
 
-	// Setup RF channel
-	setup_channel();
+	// Setup RF channel unless the stored session is resumed
+	if (!resume_session())
+		setup_channel();
 
-	set_state(st_stopped);
+	// The events so far are not relevant
+	sched_clear(ev_no_ir|ev_btn|ev_timer|ev_uart);
 
 	// Start/stop loop
-	for (;;) {
-		wait_start();
-		set_state(st_started);
-		beep(SHORT_DELAY_TICKS);
-		detect_finish();
-		set_state(st_stopped);
-		report_finish();
-	}
+	set_listening_state(st_stopped);
+	for (;;)
+		dispatch(sched_wait(~0));
 }
-
@@ -0,0 +1,82 @@
+#pragma once
+
+/*
+ * K of M beam break filter. The barrier is considered crossed when at least
+ * K of the last M bursts were broken. The crossing is timestamped by the
+ * earliest broken burst in the window so the filtering does not add latency
+ * to the reported time.
+ */
+
+#ifndef IRF_M_MAX
+#define IRF_M_MAX 8
+#endif
+
+#ifndef IRF_TS_T
+#define IRF_TS_T unsigned
+#endif
+
+struct irf_ctx {
+	unsigned char k;    // Broken bursts required
+	unsigned char m;    // Window length
+	unsigned char cnt;  // Broken bursts in the window
+	unsigned char next; // Timestamp slot for the next burst (the oldest one)
+	unsigned      hist; // Window bitmap, bit 0 is the latest burst, 1 - broken
+	IRF_TS_T      ts[IRF_M_MAX]; // Burst timestamps
+};
+
+/* Reset state to empty */
+static inline void irf_reset(struct irf_ctx* ctx)
+{
+	ctx->cnt  = 0;
+	ctx->next = 0;
+	ctx->hist = 0;
+}
+
+static inline void irf_init(struct irf_ctx* ctx, unsigned char k, unsigned char m)
+{
+	ctx->k = k;
+	ctx->m = m;
+	irf_reset(ctx);
+}
+
+/* Put the next burst result. Returns 1 if the crossing condition is met. */
+static inline int irf_put(struct irf_ctx* ctx, int broken, IRF_TS_T ts)
+{
+	unsigned last = 1U << (ctx->m - 1);
+	if (ctx->hist & last)
+		--ctx->cnt;
+	ctx->hist = (ctx->hist << 1) & (last | (last - 1));
+	if (broken) {
+		ctx->hist |= 1;
+		++ctx->cnt;
+	}
+	ctx->ts[ctx->next] = ts;
+	if (++ctx->next >= ctx->m)
+		ctx->next = 0;
+	return ctx->cnt >= ctx->k;
+}
+
+/* Returns the age (0 - the latest burst) of the earliest broken burst in the window or -1 */
+static inline int irf_first_age(struct irf_ctx const* ctx)
+{
+	int i;
+	for (i = ctx->m - 1; i >= 0; --i)
+		if (ctx->hist & (1U << i))
+			return i;
+	return -1;
+}
+
+/* Returns the timestamp of the burst with the given age */
+static inline IRF_TS_T irf_ts(struct irf_ctx const* ctx, int age)
+{
+	int i = ctx->next - 1 - age;
+	if (i < 0)
+		i += ctx->m;
+	return ctx->ts[i];
+}
+
+/* Returns the timestamp of the earliest broken burst. Should be called only if irf_put() returned 1. */
+static inline IRF_TS_T irf_first_ts(struct irf_ctx const* ctx)
+{
+	return irf_ts(ctx, irf_first_age(ctx));
+}
@@ -0,0 +1,39 @@
+#include "isr_prof.h"
+#include "uart.h"
+#include "debug.h"
+
+#ifdef ISR_PROFILE
+
+struct isr_prof g_isr_prof[prof_isr_max] = {
+	{~0}, {~0}, {~0}, {~0}
+};
+
+BUILD_BUG_ON(prof_isr_max != 4);
+
+/*
+ * Every handler is reported by 4 lines: the handler index (i),
+ * min (n), max (x) and average (a) cycles. The handlers that
+ * were not called are skipped.
+ */
+void isr_prof_report(void)
+{
+	int i;
+	for (i = 0; i < prof_isr_max; ++i) {
+		struct isr_prof p;
+		__disable_interrupt();
+		p = g_isr_prof[i];
+		g_isr_prof[i].min = ~0;
+		g_isr_prof[i].max = 0;
+		g_isr_prof[i].cnt = 0;
+		g_isr_prof[i].total = 0;
+		__enable_interrupt();
+		if (!p.cnt)
+			continue;
+		uart_send_hex('i', i);
+		uart_send_hex('n', p.min);
+		uart_send_hex('x', p.max);
+		uart_send_hex('a', (unsigned)(p.total / p.cnt));
+	}
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ * The interrupt handlers execution time profiling. Enabled by ISR_PROFILE
+ * option in common.h. The time is measured in SMCLK cycles by the free
+ * running timebase counter so the interrupt entry and exit overhead
+ * (~11 cycles) is not included.
+ */
+
+#include "io430.h"
+#include "common.h"
+
+enum {
+	prof_tick,  // System tick
+	prof_ui,    // UI slot
+	prof_burst, // IR burst end
+	prof_dma,   // Photo detector acquisition end
+	prof_isr_max
+};
+
+struct isr_prof {
+	unsigned      min;
+	unsigned      max;
+	unsigned      cnt;
+	unsigned long total;
+};
+
+#ifdef ISR_PROFILE
+
+extern struct isr_prof g_isr_prof[prof_isr_max];
+
+static inline void isr_prof_put(int id, unsigned cycles)
+{
+	struct isr_prof* p = &g_isr_prof[id];
+	if (cycles < p->min)
+		p->min = cycles;
+	if (cycles > p->max)
+		p->max = cycles;
+	// The average is calculated until the counter saturated
+	if (~p->cnt) {
+		++p->cnt;
+		p->total += cycles;
+	}
+}
+
+#define ISR_PROF_BEGIN() unsigned isr_prof_ts_ = TA1R
+#define ISR_PROF_END(id) isr_prof_put(id, TA1R - isr_prof_ts_)
+
+/* Send statistics over UART and reset it */
+void isr_prof_report(void);
+
+#else
+
+#define ISR_PROF_BEGIN()
+#define ISR_PROF_END(id)
+
+static inline void isr_prof_report(void) {}
+
+#endif
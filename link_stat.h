@@ -0,0 +1,74 @@
+#pragma once
+
+/* Link test statistics */
+
+/*
+ * The RSSI histogram bins are LINK_RSSI_STEP dB wide starting from
+ * LINK_RSSI_MIN. The LQI bins are LINK_LQI_STEP wide, the lower LQI
+ * is the better. The values out of range go to the first or the last bin.
+ */
+#define LINK_HIST_BINS 8
+#define LINK_RSSI_MIN  (-110)
+#define LINK_RSSI_STEP 10
+#define LINK_LQI_STEP  16
+
+struct link_stat {
+	unsigned      sent;
+	unsigned      received;
+	unsigned      crc_err;
+	unsigned      rtt_min;
+	unsigned      rtt_max;
+	unsigned long rtt_sum;
+	unsigned char rssi[LINK_HIST_BINS];     // RSSI seen locally
+	unsigned char rssi_rem[LINK_HIST_BINS]; // RSSI seen by the remote side
+	unsigned char lqi[LINK_HIST_BINS];      // LQI seen locally
+};
+
+static inline void link_stat_reset(struct link_stat* st)
+{
+	unsigned char* p = (unsigned char*)st;
+	unsigned i;
+	for (i = 0; i < sizeof(*st); ++i)
+		p[i] = 0;
+	st->rtt_min = ~0;
+}
+
+static inline int link_stat_bin(int val, int min, int step)
+{
+	int bin;
+	if (val < min)
+		return 0;
+	bin = (val - min) / step;
+	return bin < LINK_HIST_BINS ? bin : LINK_HIST_BINS - 1;
+}
+
+static inline void link_stat_hist_put(unsigned char* hist, int bin)
+{
+	if (hist[bin] < 0xff)
+		++hist[bin];
+}
+
+/* Account the reply received. The RSSI values are in dBm. */
+static inline void link_stat_put(struct link_stat* st, unsigned rtt, int rssi, int rssi_rem, int lqi)
+{
+	++st->received;
+	st->rtt_sum += rtt;
+	if (rtt < st->rtt_min)
+		st->rtt_min = rtt;
+	if (rtt > st->rtt_max)
+		st->rtt_max = rtt;
+	link_stat_hist_put(st->rssi,     link_stat_bin(rssi,     LINK_RSSI_MIN, LINK_RSSI_STEP));
+	link_stat_hist_put(st->rssi_rem, link_stat_bin(rssi_rem, LINK_RSSI_MIN, LINK_RSSI_STEP));
+	link_stat_hist_put(st->lqi,      link_stat_bin(lqi,      0,             LINK_LQI_STEP));
+}
+
+static inline unsigned link_stat_rtt_avg(struct link_stat const* st)
+{
+	return st->received ? st->rtt_sum / st->received : 0;
+}
+
+/* Packet error rate in percents */
+static inline unsigned link_stat_per(struct link_stat const* st)
+{
+	return st->sent ? (unsigned long)(st->sent - st->received) * 100 / st->sent : 0;
+}
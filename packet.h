@@ -14,9 +14,20 @@ enum {
 	pkt_setup_resp,
 	pkt_start,
 	pkt_finish,
+	pkt_echo,
+	pkt_resume,
+	pkt_query,
+	pkt_sync,
+	pkt_batch,
+	pkt_batch_ack,
+	pkt_setup_ack,
 	pkt_ping   = 0x20,
 	pkt_status = 0x40,
 	pkt_reset  = 0x80,
+	// The flag may be combined with the packet type to send the extended
+	// payload. Otherwise only the data meaningful for the particular packet
+	// type is sent. See pkt_len() for details.
+	pkt_ext    = 0x10,
 };
 
 // Error flags
@@ -30,7 +41,8 @@ enum {
 
 // Status flags
 enum {
-	sta_no_ir = 0x1,
+	sta_no_ir    = 0x1,
+	sta_low_batt = 0x2,
 };
 
 struct link_info {
@@ -43,11 +55,33 @@ struct link_info {
 
 BUILD_BUG_ON(sizeof(struct link_info) != 2);
 
+// The run result as sent in pkt_batch
+struct run_result {
+	unsigned long time; // The time in msec
+	unsigned char sn;   // The run sequence number (from the start packet)
+	unsigned char err;  // err_timeout or 0
+};
+
+BUILD_BUG_ON(sizeof(struct run_result) != 6);
+
+// The number of results in one pkt_batch frame
+#define BATCH_RESULTS 4
+// The max number of frames acknowledged at once (the bits in pkt_batch_ack mask)
+#define BATCH_WINDOW  8
+// The number of the frames window retransmissions
+#define BATCH_TRIES   3
+// The time the start waits for the next frame (the full frame takes ~1.8 sec on air)
+#define BATCH_FRAME_TIMEOUT (3*TICK_HZ)
+// The time the finish waits for the acknowledgement
+#define BATCH_ACK_TIMEOUT   (2*BATCH_FRAME_TIMEOUT)
+
 struct packet {
+	unsigned char se;   // Session ID (random number) common for all messages.
+	                    // Goes first since it is used as the radio address (see rf_set_addr).
 	unsigned char type; // Packet type
 	unsigned char sn;   // Packet seq number incremented in each packet
-	unsigned char se;   // Session ID (random number) common for all messages
 	unsigned char err;  // Remote side error mask
+	struct link_info li;// Link quality of the last valid packet received from the remote side
 	// Packet data
 	union {
 		// pkt_setup
@@ -56,13 +90,32 @@ struct packet {
 			unsigned char chan; // Working channel
 			unsigned char flags;// Flags (SETUP_F_XXX)
 		} setup;
-#define SETUP_F_TEST 1
-#define SETUP_RESP_DELAY 8
+#define SETUP_F_TEST      1
+#define SETUP_F_DIVERSITY 2 // Use diversity mode (see rf_buff.h)
+#define SETUP_RESP_DELAY 10
 		// pkt_setup_resp
-		// Sent from finish to start in response to the pkt_setup
+		// Sent from finish to start in response to the pkt_setup. Several finishes
+		// hearing the same setup respond in the random slots to avoid collision.
+		// The link quality seen by the finish is in the header. The length should
+		// match pkt_start since the setup round trip gives the start offset.
 		struct {
-			struct link_info li; // Link quality info as seen by remote side
+			unsigned char id;    // The finish unit ID
+			unsigned char slot;  // The response slot
 		} setup_resp;
+#define SETUP_SLOTS      4
+#define SETUP_SLOT_TICKS TICK_HZ // Longer than the setup_resp airtime
+// The start collects the responses that long after sending pkt_setup
+#define SETUP_WINDOW     (SETUP_RESP_DELAY + (SETUP_SLOTS + 2) * SETUP_SLOT_TICKS)
+// The number of pkt_setup attempts made by the start
+#define SETUP_TRIES      3
+		// pkt_setup_ack
+		// Sent from start to finish at the end of the setup window to confirm the
+		// finish chosen. The finishes not chosen return to the control channel.
+		struct {
+			unsigned char id;    // The finish unit ID
+		} setup_ack;
+// The finish waits for pkt_setup_ack that long after responding
+#define SETUP_ACK_TIMEOUT (SETUP_WINDOW + 2 * TICK_HZ)
 		// pkt_start
 		// Sent from start to finish to start timer
 		struct {
@@ -72,8 +125,38 @@ struct packet {
 		// Sent from finish to start in response to start command after finish crossing detection
 		// In case of timeout the message will have invalid time and err_timeout bit set.
 		struct {
-			unsigned time; // The time in 1/100 sec (BCD code).
+			unsigned long time; // The time in msec
 		} finish;
+		// pkt_echo
+		// Sent from start to finish during the link test, the finish
+		// replies immediately with the same packet. No data.
+		// pkt_resume
+		// Sent from start to finish on the working channel after reboot to verify
+		// the session stored in nvram. The finish replies with the same packet. No data.
+		// pkt_query
+		// Sent from start to finish to query the result of the run given by the sequence
+		// number in the header. The finish answers by pkt_finish if the result is known. No data.
+		// pkt_sync
+		// Sent from start to finish to fetch all results starting from the given run
+		// sequence number. The finish responds with the window of pkt_batch frames.
+		struct {
+			unsigned char first_sn;
+		} sync;
+		// pkt_batch
+		// Sent from finish to start in response to pkt_sync. The frames missing
+		// in the start acknowledgement are retransmitted.
+		struct {
+			unsigned char frame;  // The frame index
+			unsigned char frames; // The total number of frames
+			unsigned char cnt;    // The number of results in this frame
+			unsigned char reserved;
+			struct run_result res[BATCH_RESULTS];
+		} batch;
+		// pkt_batch_ack
+		// Sent from start to finish after the window of pkt_batch frames
+		struct {
+			unsigned char mask; // The frames received so far
+		} batch_ack;
 		// pkt_status
 		// Sent from finish to start to alert operator
 		struct {
@@ -83,11 +166,43 @@ struct packet {
 	};
 };
 
-BUILD_BUG_ON(sizeof(struct packet) != 6);
+BUILD_BUG_ON(sizeof(struct packet) != 34);
+
+// The header common for all packets
+#define PKT_HDR_LEN 6
+// The pkt_batch header preceding the results
+#define BATCH_HDR_LEN 4
+
+/*
+ * Returns the packet length sent over the air. The data not sent are
+ * zeroed on receive. So the pkt_finish carries the low 16 bits of
+ * the time only unless pkt_ext flag is set. The pkt_batch length
+ * depends on the number of results it carries.
+ */
+static inline unsigned char pkt_len(struct packet const* p)
+{
+	switch (p->type & ~pkt_ext) {
+	case pkt_setup:
+	case pkt_setup_resp:
+	case pkt_start:
+	case pkt_status:
+		return PKT_HDR_LEN + 2;
+	case pkt_finish:
+		return PKT_HDR_LEN + (p->type & pkt_ext ? 4 : 2);
+	case pkt_sync:
+	case pkt_batch_ack:
+	case pkt_setup_ack:
+		return PKT_HDR_LEN + 1;
+	case pkt_batch:
+		return PKT_HDR_LEN + BATCH_HDR_LEN + p->batch.cnt * sizeof(struct run_result);
+	default:
+		return PKT_HDR_LEN;
+	}
+}
 
 struct packet_buff {
 	struct packet p;
 	struct link_info li;
 };
 
-BUILD_BUG_ON(sizeof(struct packet_buff) != 8);
+BUILD_BUG_ON(sizeof(struct packet_buff) != 36);
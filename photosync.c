@@ -1,26 +1,41 @@
 #include "io430.h"
 #include "common.h"
 #include "photosync.h"
+#include "sched.h"
+#include "isr_prof.h"
+#include "debug.h"
 
-#define DET_LO /* Detect signal going low */
-#define DET_HI /* Detect signal going high */
-
-#define SHT_MAX 12
 #define ADC_CLR_SHT 2
-#define HI_THR 3500
-#define LO_THR 1700
-#define OVERLOAD 4095
-
-#define DET_MIN_CNT 2
-#define DET_MIN_THR 3
-#define DET_SNR_THR 6
-#define DET_SIG_FRACTION 4
 
 #define ADC_INP_CHANEL ADC12INCH_0
 //#define ADC_INP_CHANEL ADC12INCH_10 /* Temp sensor for testing */
 #define ADC_REF ADC12SREF_1 // V(R+) = VREF+ and V(R-) = AVSS
 
-#define BURST_BITS(sht) ((SHT_MAX - sht) / 3)
+#define BURST_MAX_BITS  BURST_BITS(0)
+
+// Time slot margin (MCLK cycles) over the sample-hold time and conversion
+#define SLOT_MARGIN 24
+#define CONV_CYCLES 13
+
+// The sample-hold times in ADC clock cycles for every ADC12SHTx setting
+static const unsigned sht_cycles[16] = {
+	SHT_CYCLES(0),  SHT_CYCLES(1),  SHT_CYCLES(2),  SHT_CYCLES(3),
+	SHT_CYCLES(4),  SHT_CYCLES(5),  SHT_CYCLES(6),  SHT_CYCLES(7),
+	SHT_CYCLES(8),  SHT_CYCLES(9),  SHT_CYCLES(10), SHT_CYCLES(11),
+	SHT_CYCLES(12), SHT_CYCLES(13), SHT_CYCLES(14), SHT_CYCLES(15)
+};
+
+// The autoscale range should be within the table
+BUILD_BUG_ON(SHT_MAX > 15);
+
+// The samples are stored here by DMA
+static unsigned phs_buff[2 << BURST_MAX_BITS];
+// Photo-diode pin direction patterns for discharge/measure conversions
+static unsigned char phs_pin_dir[2];
+// IR LED output control patterns for the successive slots
+static const unsigned phs_led_ctl[4] = {OUTMOD_0, OUTMOD_0, OUTMOD_0|OUT, OUTMOD_0|OUT};
+// The context of the acquisition in progress
+static struct phs_ctx* volatile phs_active;
 
 void phs_init(struct phs_ctx* ctx)
 {
@@ -29,38 +44,22 @@ void phs_init(struct phs_ctx* ctx)
 	P2DIR |= BIT0;
 	P2SEL |= BIT0|BIT5; // P2.5 is refereference output connected to the photo-diode (cathode)
 	P1DS |= IR_BITS;    // Max drive strength for IR LEDs
+	// Route TA0.2 output to the IR LED pin
+	PMAPKEYID = PMAPKEY;
+	P1MAP5 = PM_TA0CCR2A;
+	PMAPKEYID = 0;
 	// Configure reference: 1.5V, output enable
 	REFCTL0 = REFMSTR|REFON|REFOUT;
-	// Use MCLK for ADC (just to be in sync with code execution)
-	ADC12CTL1  = ADC12SSEL_2|ADC12SHP;
-	// Configure input channel
-	ADC12MCTL0 = ADC_INP_CHANEL|ADC_REF;
+	// Use MCLK for ADC (to be in sync with timers), repeat sequence triggered by TA0.1
+	ADC12CTL1  = ADC12CSTARTADD_7|ADC12SHS_1|ADC12SSEL_2|ADC12SHP|ADC12CONSEQ_3;
+	// Configure the sequence of discharge and measurement conversions on the same channel
+	ADC12MCTL7 = ADC_INP_CHANEL|ADC_REF;
+	ADC12MCTL8 = ADC_INP_CHANEL|ADC_REF|ADC12EOS;
 	// Start from the less sensitive range
 	ctx->sht = 0;
 	phs_restart(ctx);
 }
 
-void phs_restart(struct phs_ctx* ctx)
-{
-	aver_arr_reset(ctx->asample, 2);
-	aver_arr_reset(ctx->asignal, 2);
-	aver_arr_reset(ctx->anoise, 2);
-	ctx->detected = ctx->detected_cnt = 0;
-	ctx->ready = 0;
-	ctx->burst_bits = BURST_BITS(ctx->sht);
-}
-
-static inline void phs_adc_on(unsigned sht)
-{
-	ADC12CTL0  = ADC12ON|(sht << 8);
-	ADC12CTL0 |= ADC12ENC;
-}
-
-static inline void phs_adc_off()
-{
-	ADC12CTL0 &= ~(ADC12ON|ADC12ENC);
-}
-
 /*
  * The photosensor design is simple/stupid. There are only 2
  * external components - IR LED and photodiode (PHD). The
@@ -72,138 +71,124 @@ static inline void phs_adc_off()
  * capacitor (~25pF) as well as the PHD itself (~10pF).
  * So we can change the sensitivity by just changing the
  * sample-hold time.
+ *
+ * The whole run is performed by hardware. The TA0 period is
+ * the conversion time slot. Its TA0.1 output triggers the ADC
+ * repeating the sequence of 2 conversions. The first one with
+ * short sample-hold time discharges the sample-hold capacitor
+ * while the pin is driven low. The second one measures the
+ * photocurrent with the pin switched to input. The pin direction
+ * is switched at the slot start by DMA1 triggered by TA0 CCR0.
+ * The IR LED is driven by the TA0.2 output. Its level is set by
+ * DMA2 on the same trigger so it is lit for every other sequence
+ * leaving TA1 to the system timebase. DMA0
+ * stores measurements to the buffer and interrupts at the end of
+ * the run so the CPU is involved only to process the result.
  */
 
-static inline int phs_conversion(unsigned sht, char inp_en)
+static void phs_acquire_start(struct phs_ctx* ctx)
 {
-	// Disable interrupts for predictable timing
-	__disable_interrupt();
-	// Initialize ADC
-	phs_adc_on(sht);
-	if (inp_en) P2DIR &= ~BIT0;
-	// Start conversion
-	ADC12CTL0 |= ADC12SC;
-	// The conversion is started so we can enable interrupts
-	__enable_interrupt();
-	// Wait conversion completion
-	while (!(ADC12IFG & ADC12IFG0))
-		__no_operation();
-	if (inp_en) P2DIR |= BIT0;
-	// Turn off ADC
-	phs_adc_off();
-	// Return result
-	return ADC12MEM0;
+	unsigned cnt  = 2 << ctx->burst_bits;
+	unsigned slot = sht_cycles[ctx->sht] + CONV_CYCLES + SLOT_MARGIN;
+
+	phs_active = ctx;
+	ctx->acquired = 0;
+
+	// Pin patterns for discharge and measure slots
+	phs_pin_dir[0] = P2DIR | BIT0;
+	phs_pin_dir[1] = P2DIR & ~BIT0;
+
+	// DMA0 collects measurements
+	DMACTL0 = DMA1TSEL_1 | DMA0TSEL_24; // DMA1 - TA0CCR0, DMA0 - ADC12IFGx
+	__data16_write_addr((unsigned short)&DMA0SA, (unsigned long)&ADC12MEM8);
+	__data16_write_addr((unsigned short)&DMA0DA, (unsigned long)phs_buff);
+	DMA0SZ = cnt;
+	DMA0CTL = DMADT_0 | DMADSTINCR_3 | DMASRCINCR_0 | DMAEN | DMAIE;
+	// DMA1 switches the pin direction
+	__data16_write_addr((unsigned short)&DMA1SA, (unsigned long)phs_pin_dir);
+	__data16_write_addr((unsigned short)&DMA1DA, (unsigned long)&P2DIR);
+	DMA1SZ = 2;
+	DMA1CTL = DMADT_4 | DMADSTINCR_0 | DMASRCINCR_3 | DMASRCBYTE | DMADSTBYTE | DMAEN;
+	// DMA2 switches the LED 2 slots ahead the measurement sequence
+	DMACTL1 = DMA2TSEL_1; // DMA2 - TA0CCR0
+	__data16_write_addr((unsigned short)&DMA2SA, (unsigned long)phs_led_ctl);
+	__data16_write_addr((unsigned short)&DMA2DA, (unsigned long)&TA0CCTL2);
+	DMA2SZ = 4;
+	DMA2CTL = DMADT_4 | DMADSTINCR_0 | DMASRCINCR_3 | DMAEN;
+
+	// Start ADC
+	ADC12CTL0  = ADC12ON | (ctx->sht << 12) | (ADC_CLR_SHT << 8);
+	ADC12CTL0 |= ADC12ENC;
+
+	// TA0 is the conversion slot timer
+	TA0CCR0  = slot - 1;
+	TA0CCR1  = slot / 2;
+	TA0CCTL1 = OUTMOD_7;
+	TA0CCTL2 = OUTMOD_0;
+	P1SEL   |= IR_PWM_BIT;
+
+	TA0CTL = TASSEL_2 | MC__UP | TACLR;
 }
 
-static int phs_get_sample(unsigned sht, char ir_on)
+static void phs_acquire_stop(void)
 {
-	int sample;
-	if (ir_on) P1OUT |= IR_BITS;
-	// Dummy measurement to discharge sample-hold capacitor
-	phs_conversion(ADC_CLR_SHT, 0);
-	sample = phs_conversion(sht,  1);
-	if (ir_on) P1OUT &= ~IR_BITS;
-	return sample;
+	TA0CTL = 0;
+	TA0CCTL2 = OUTMOD_0;
+	P1SEL &= ~IR_PWM_BIT;
+	ADC12CTL0 &= ~(ADC12ON|ADC12ENC);
+	DMA1CTL = 0;
+	DMA2CTL = 0;
+	P2DIR |= BIT0;
 }
 
-static void phs_acquire(struct phs_ctx* ctx)
+#pragma vector=DMA_VECTOR
+__interrupt void DMA_ISR(void)
 {
+	ISR_PROF_BEGIN();
+	switch (__even_in_range(DMAIV, 16)) {
+	case 2: // DMA0IFG
+		phs_acquire_stop();
+		phs_active->acquired = 1;
+		sched_post(ev_acquired);
+		__low_power_mode_off_on_exit();
+		ISR_PROF_END(prof_dma);
+		break;
+	}
+}
+
+static void phs_acquire_complete(struct phs_ctx* ctx)
+{
+	unsigned const* s = phs_buff;
 	int loops;
 	ctx->sample[0] = ctx->sample[1] = 0;
-	// Run up to 16 cycles
 	for (loops = 1 << ctx->burst_bits; loops; --loops) {
-		/* Run 2 measurement cycles with IR off/on */
-		ctx->sample[0] += phs_get_sample(ctx->sht, 0);
-		ctx->sample[1] += phs_get_sample(ctx->sht, 1);
+		/* Samples with IR off/on are interleaved */
+		ctx->sample[0] += *s++;
+		ctx->sample[1] += *s++;
 	}
 	ctx->signal = ctx->sample[1] - ctx->sample[0];
 	ctx->sample[0] >>= ctx->burst_bits;
 	ctx->sample[1] >>= ctx->burst_bits;
 }
 
-static inline int abs(int v)
-{
-	return v >= 0 ? v : -v;
-}
-
-static void phs_detect(struct phs_ctx* ctx)
+void phs_start(struct phs_ctx* ctx)
 {
-	if (ctx->detected_cnt) {
-#ifdef DET_LO
-		if (!ctx->detected_hi) {
-			if (ctx->signal < ctx->detected_thr)
-				++ctx->detected_cnt;
-			else
-				ctx->detected_cnt = 0;
-		}
-#endif
-#ifdef DET_HI
-		if (ctx->detected_hi) {
-			if (ctx->signal > ctx->detected_thr)
-				++ctx->detected_cnt;
-			else
-				ctx->detected_cnt = 0;
-		}
-#endif
-	} else {
-		int thr = DET_MIN_THR;
-		int aver_signal = aver_value(&ctx->asignal[1]);
-		int noise_thr   = aver_value(&ctx->anoise[1]);
-		int signal_thr  = aver_signal / DET_SIG_FRACTION;
-		if (thr < noise_thr)
-			thr = noise_thr;
-		if (thr < signal_thr)
-			thr = signal_thr;
-#ifdef DET_LO
-		if (ctx->signal < aver_signal - thr) {
-			ctx->detected_cnt = 1;
-			ctx->detected_hi  = 0;
-			ctx->detected_thr = aver_signal - thr;
-		}
-#endif
-#ifdef DET_HI
-		if (ctx->signal > aver_signal + thr) {
-			ctx->detected_cnt = 1;
-			ctx->detected_hi  = 1;
-			ctx->detected_thr = aver_signal + thr;
-		}
-#endif
-	}
-	if (ctx->detected_cnt >= DET_MIN_CNT) {
-		ctx->detection = 0;
-		ctx->detected = 1;
-	}
+	phs_acquire_start(ctx);
 }
 
-void phs_process(struct phs_ctx* ctx)
+int phs_poll(struct phs_ctx* ctx)
 {
-	if (ctx->detection && ctx->ready)
-		phs_detect(ctx);
-
-	if (!ctx->detected_cnt && ctx->autoscale) {
-		// Auto scaling
-		if (ctx->sht > 0 && ctx->sample[1] > HI_THR) {
-			--ctx->sht;
-			phs_restart(ctx);
-			return;
-		}
-		if (ctx->sht < SHT_MAX && ctx->sample[1] < LO_THR) {
-			++ctx->sht;
-			phs_restart(ctx);
-			return;
-		}
-	}
-
-	ctx->overload = (ctx->sample[0] >= OVERLOAD || ctx->sample[1] >= OVERLOAD);
-	aver_arr_put(ctx->asample, 2, ctx->sample[1]);
-	aver_arr_put(ctx->asignal, 2, ctx->signal);
-	if (ctx->asignal[1].ready)
-		aver_arr_put(ctx->anoise, 2, DET_SNR_THR * abs(ctx->signal - aver_value(&ctx->asignal[1])));
-	ctx->ready = ctx->anoise[1].ready;
+	if (!ctx->acquired)
+		return 0;
+	ctx->acquired = 0;
+	phs_acquire_complete(ctx);
+	phs_process(ctx);
+	return 1;
 }
 
 void phs_run(struct phs_ctx* ctx)
 {
-	phs_acquire(ctx);
-	phs_process(ctx);
+	phs_start(ctx);
+	while (!phs_poll(ctx))
+		__no_operation();
 }
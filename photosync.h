@@ -4,19 +4,34 @@
 
 #include "aver.h"
 
+#define SHT_MAX 12
+#define BURST_BITS(sht) ((SHT_MAX - sht) / 3)
+
+/*
+ * The sample-hold time in ADC clock cycles for the ADC12SHTx setting:
+ * 4, 8, 16, 32, 64, 96, 128, 192, 256, 384, 512, 768 and 1024 for 1100b-1111b
+ */
+#define SHT_CYCLES(sht) ((sht) < 4 ? 4 << (sht) : (sht) >= 12 ? 1024 : \
+	(sht) & 1 ? 96 << (((sht) - 5) >> 1) : 64 << (((sht) - 4) >> 1))
+
 struct phs_ctx {
 	char autoscale;    // Autoscale enabled
 	char detection;    // Detection enabled
 	char detected;     // Detected flag
 	char ready;        // Ready flag
+	volatile char acquired; // Acquisition completed
 	char overload;     // Overload by too bright ambient light
 	char sht;          // Current sample-hold time setting
 	char burst_bits;   // The log of the number of conversions in one run
 	char detected_cnt; // The number of runs where detection takes place
 	char detected_hi;  // The detection polarity (1-high pulse, -1-low pulse)
 	int  detected_thr; // The signal threshold
+	unsigned char detected_frac; // The crossing time before the detected_run in 1/256 of run period
+	unsigned detected_run; // The run where the threshold was crossed first
+	unsigned run;      // Run counter
 	unsigned sample[2];// Samples collected during the last run for IR off/on
 	int  signal;   // Signal
+	int  prev_signal;  // Signal on the previous run
 	// Sliding average buffers collecting samples with IR on, synch signal and its deviation
 	struct aver_ctx asample[2];
 	struct aver_ctx asignal[2];
@@ -30,6 +45,51 @@ static inline void phs_set_mode(struct phs_ctx* ctx, char autoscale, char detect
 	ctx->detected = ctx->detected_cnt = 0;
 }
 
+/*
+ * Returns the crossing time in run periods as 24.8 fixed point number.
+ * Valid after detection.
+ */
+static inline unsigned long phs_detected_time(struct phs_ctx const* ctx)
+{
+	return ((unsigned long)ctx->detected_run << 8) - ctx->detected_frac;
+}
+
+/*
+ * Back-dates the current run start time t to the threshold crossing. The
+ * period is the run period in the units of t. Valid while detected_cnt != 0.
+ */
+static inline unsigned long phs_crossing_time(struct phs_ctx const* ctx, unsigned long t, unsigned period)
+{
+	unsigned runs = ctx->run - ctx->detected_run;
+	unsigned long back = ((unsigned long)runs << 8) + ctx->detected_frac;
+	return t - ((back * period + 0x80) >> 8);
+}
+
+/*
+ * The raw run record streamed in capture mode. The multibyte
+ * values are little endian.
+ */
+#define PHS_REC_SYNC 0xa5
+#define PHS_REC_SZ   8
+
+static inline void phs_record(struct phs_ctx const* ctx, unsigned char rec[PHS_REC_SZ])
+{
+	rec[0] = PHS_REC_SYNC;
+	rec[1] = ctx->sht;
+	rec[2] = ctx->sample[0];
+	rec[3] = ctx->sample[0] >> 8;
+	rec[4] = ctx->sample[1];
+	rec[5] = ctx->sample[1] >> 8;
+	rec[6] = ctx->signal;
+	rec[7] = ctx->signal >> 8;
+}
+
 void phs_init(struct phs_ctx* ctx);
 void phs_restart(struct phs_ctx* ctx);
 void phs_run(struct phs_ctx* ctx);
+void phs_process(struct phs_ctx* ctx);
+
+/* Start acquisition in background */
+void phs_start(struct phs_ctx* ctx);
+/* Process the run if acquisition is completed. Returns 1 if processed. */
+int  phs_poll(struct phs_ctx* ctx);
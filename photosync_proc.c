@@ -0,0 +1,133 @@
+/*
+ * Synchronous photo-detector signal processing.
+ * It does not access hardware so the same code may be used for offline replay.
+ */
+
+#include "photosync.h"
+
+#define DET_LO /* Detect signal going low */
+#define DET_HI /* Detect signal going high */
+
+#define HI_THR 3500
+#define LO_THR 1700
+#define OVERLOAD 4095
+
+#define DET_MIN_CNT 2
+#define DET_MIN_THR 3
+#define DET_SNR_THR 6
+#define DET_SIG_FRACTION 4
+
+void phs_restart(struct phs_ctx* ctx)
+{
+	aver_arr_reset(ctx->asample, 2);
+	aver_arr_reset(ctx->asignal, 2);
+	aver_arr_reset(ctx->anoise, 2);
+	ctx->detected = ctx->detected_cnt = 0;
+	ctx->ready = 0;
+	ctx->burst_bits = BURST_BITS(ctx->sht);
+}
+
+static inline int abs(int v)
+{
+	return v >= 0 ? v : -v;
+}
+
+/*
+ * Record the first threshold crossing. The crossing instant is interpolated
+ * linearly between the previous and the current run. The fraction of the run
+ * period the crossing took place before the current run is saved in 1/256 units.
+ */
+static void phs_crossing(struct phs_ctx* ctx, int thr)
+{
+	long num = (long)ctx->signal - thr;
+	long den = (long)ctx->signal - ctx->prev_signal;
+	long frac = 0;
+	if (den)
+		frac = (num << 8) / den;
+	if (frac < 0)
+		frac = 0;
+	if (frac > 255)
+		frac = 255;
+	ctx->detected_run  = ctx->run;
+	ctx->detected_frac = (unsigned char)frac;
+}
+
+static void phs_detect(struct phs_ctx* ctx)
+{
+	if (ctx->detected_cnt) {
+#ifdef DET_LO
+		if (!ctx->detected_hi) {
+			if (ctx->signal < ctx->detected_thr)
+				++ctx->detected_cnt;
+			else
+				ctx->detected_cnt = 0;
+		}
+#endif
+#ifdef DET_HI
+		if (ctx->detected_hi) {
+			if (ctx->signal > ctx->detected_thr)
+				++ctx->detected_cnt;
+			else
+				ctx->detected_cnt = 0;
+		}
+#endif
+	} else {
+		int thr = DET_MIN_THR;
+		int aver_signal = aver_value(&ctx->asignal[1]);
+		int noise_thr   = aver_value(&ctx->anoise[1]);
+		int signal_thr  = aver_signal / DET_SIG_FRACTION;
+		if (thr < noise_thr)
+			thr = noise_thr;
+		if (thr < signal_thr)
+			thr = signal_thr;
+#ifdef DET_LO
+		if (ctx->signal < aver_signal - thr) {
+			ctx->detected_cnt = 1;
+			ctx->detected_hi  = 0;
+			ctx->detected_thr = aver_signal - thr;
+			phs_crossing(ctx, ctx->detected_thr);
+		}
+#endif
+#ifdef DET_HI
+		if (ctx->signal > aver_signal + thr) {
+			ctx->detected_cnt = 1;
+			ctx->detected_hi  = 1;
+			ctx->detected_thr = aver_signal + thr;
+			phs_crossing(ctx, ctx->detected_thr);
+		}
+#endif
+	}
+	if (ctx->detected_cnt >= DET_MIN_CNT) {
+		ctx->detection = 0;
+		ctx->detected = 1;
+	}
+}
+
+void phs_process(struct phs_ctx* ctx)
+{
+	++ctx->run;
+	if (ctx->detection && ctx->ready)
+		phs_detect(ctx);
+	ctx->prev_signal = ctx->signal;
+
+	if (!ctx->detected_cnt && ctx->autoscale) {
+		// Auto scaling
+		if (ctx->sht > 0 && ctx->sample[1] > HI_THR) {
+			--ctx->sht;
+			phs_restart(ctx);
+			return;
+		}
+		if (ctx->sht < SHT_MAX && ctx->sample[1] < LO_THR) {
+			++ctx->sht;
+			phs_restart(ctx);
+			return;
+		}
+	}
+
+	ctx->overload = (ctx->sample[0] >= OVERLOAD || ctx->sample[1] >= OVERLOAD);
+	aver_arr_put(ctx->asample, 2, ctx->sample[1]);
+	aver_arr_put(ctx->asignal, 2, ctx->signal);
+	if (ctx->asignal[1].ready)
+		aver_arr_put(ctx->anoise, 2, DET_SNR_THR * abs(ctx->signal - aver_value(&ctx->asignal[1])));
+	ctx->ready = ctx->anoise[1].ready;
+}
@@ -1,48 +1,280 @@
 #include "io430.h"
 #include "rf_buff.h"
 #include "display.h"
+#include "sched.h"
+#include "trace.h"
+#include "backoff.h"
 
-void rfb_send_msg_(struct rf_buff* rf, unsigned char type, void (*cb)(void))
+/*
+ * The packets used for the start offset measurement and the start packet
+ * carrying the offset are sent without listening the channel since
+ * deferring them would break the timing.
+ */
+static int rfb_timing_critical(unsigned char type)
 {
+	return type == pkt_setup || type == pkt_setup_resp || type == pkt_start;
+}
+
+/*
+ * The PATABLE values from the max power down to -30dBm. The power is set
+ * to the lowest one keeping the RSSI seen by the remote side above the
+ * RFB_PWR_TARGET. Every step is 3..10 dB so the hysteresis is large enough
+ * to prevent oscillation.
+ */
+static const unsigned char s_pa_table[] = {
+	RF_PATABLE_VAL, 0xc8, 0x84, 0x60, 0x34, 0x1d, 0x0e, 0x12
+};
+
+#define RFB_PWR_LEVELS (int)(sizeof(s_pa_table) / sizeof(s_pa_table[0]))
+#define RFB_PWR_TARGET (-85) // dBm, ~25dB above the sensitivity
+#define RFB_PWR_HYST   12    // dB
+
+void rfb_set_power(struct rf_buff* rf, int level)
+{
+	if (level < 0)
+		level = 0;
+	if (level >= RFB_PWR_LEVELS)
+		level = RFB_PWR_LEVELS - 1;
+	if (level != rf->pa_level)
+		trace(tr_tx_pwr, level);
+	rf->pa_level = level;
+	rf_set_power(s_pa_table[level]);
+}
+
+// Called on valid packet reception
+static void rfb_power_control(struct rf_buff* rf)
+{
+	int rssi;
+	// Echo the link quality to the remote side
+	rf->tx.li = rf->rx.li;
+	if (!rf->rx.p.li.crc_ok)
+		// The remote side has not received our packets yet
+		return;
+	rssi = RF_RSSI_DBM(rf->rx.p.li.rssi);
+	if (rssi < RFB_PWR_TARGET)
+		rfb_set_power(rf, rf->pa_level - 1);
+	else if (rssi > RFB_PWR_TARGET + RFB_PWR_HYST)
+		rfb_set_power(rf, rf->pa_level + 1);
+}
+
+unsigned rfb_rand(struct rf_buff* rf)
+{
+	// The timer phase is random relative to the radio events
+	return cca_rand(&rf->rnd, rf_rssi() + TA1R);
+}
+
+static void rfb_try_send(struct rf_buff* rf)
+{
+	if (rf->deferrals >= CCA_MAX_DEFERRALS) {
+		// Don't wait any longer
+		rf_tx_start();
+	} else if (!rf_tx_cca()) {
+		trace(tr_cca_busy, rf->deferrals);
+		++rf->cca_deferrals;
+		rf->mode = rfb_deferred;
+		sched_timer_start(ev_radio, cca_backoff(rfb_rand(rf), rf->deferrals++));
+		return;
+	}
+	rf->mode = rfb_sending;
+}
+
+void rfb_send(struct rf_buff* rf, unsigned char type)
+{
+	trace(tr_tx, type);
 	rf->tx.type = type;
 	if (!rf->master)
 		rf->tx.sn = rf->rx.p.sn;
-	rf_tx((unsigned char*)&rf->tx, sizeof(rf->tx));
+	sched_clear(ev_radio);
+	rf_tx_load((unsigned char*)&rf->tx, pkt_len(&rf->tx));
 	rf->tx.err = 0;
-	while (!rf_tx_test())
-		if (cb) cb();
+	if (rfb_timing_critical(type)) {
+		rf->mode = rfb_sending;
+		rf_tx_start();
+	} else {
+		rf->deferrals = 0;
+		rfb_try_send(rf);
+	}
+}
+
+void rfb_listen(struct rf_buff* rf)
+{
+	rf->mode = rfb_listening;
+	rf_rx_on();
+	if (rf->div_on)
+		sched_timer_start(ev_radio, RFB_DIV_DWELL_TICKS);
+}
+
+void rfb_cancel(struct rf_buff* rf)
+{
+	if (rf->mode == rfb_listening) {
+		rf_rx_off();
+		if (rf->div_on)
+			sched_timer_stop(ev_radio);
+	}
+	if (rf->mode == rfb_deferred) {
+		sched_timer_stop(ev_radio);
+		rf_tx_flush();
+	}
+	rf->mode = rfb_idle;
+	sched_clear(ev_radio);
+}
+
+static void rfb_read(struct rf_buff* rf)
+{
+	unsigned char* data = (unsigned char*)&rf->rx.p;
+	unsigned char len = rf_rx_len();
+	if (len > sizeof(rf->rx.p)) {
+		// Should be filtered out by the radio anyway
+		rf_rx_off();
+		rf->rx.li.crc_ok = 0;
+		return;
+	}
+	rf_rx_read(data, len);
+	rf_rx_read((unsigned char*)&rf->rx.li, sizeof(rf->rx.li));
+	// Zero the data not sent
+	for (data += len; len < sizeof(rf->rx.p); ++len)
+		*data++ = 0;
+	rf->rx.p.type &= ~pkt_ext;
+}
+
+// The diversity dwell timer expired while listening
+static void rfb_div_hop(struct rf_buff* rf)
+{
+	// Stay on the channel if the packet is being received
+	if (!rf_rx_busy() && !rf_rx_test()) {
+		rf_rx_off();
+		rfb_div_select(rf, rf->div_ch + 1);
+		rf_rx_on();
+	}
+	sched_timer_start(ev_radio, RFB_DIV_DWELL_TICKS);
+}
+
+int rfb_complete(struct rf_buff* rf)
+{
+	int mode = rf->mode;
+	if (mode == rfb_deferred) {
+		// The backoff timer expired
+		rfb_try_send(rf);
+		return 0;
+	}
+	if (mode == rfb_listening && rf->div_on) {
+		if (!rf_rx_test()) {
+			rfb_div_hop(rf);
+			return 0;
+		}
+		sched_timer_stop(ev_radio);
+	}
+	if (mode == rfb_idle || !(mode == rfb_sending ? rf_tx_test() : rf_rx_test()))
+		return 0;
+	rf->mode = rfb_idle;
+	if (mode == rfb_listening)
+		rfb_read(rf);
+	return mode;
+}
+
+void rfb_div_calibrate(struct rf_buff* rf)
+{
+	if (!rf->div_on)
+		return;
+	// The working channel calibration is the last one so it is left selected
+	rf_calibrate(&rf->div_cal[1], rfb_div_channel(rf->div_cal[0].ch));
+	rf_calibrate(&rf->div_cal[0], rf->div_cal[0].ch);
+	rf_set_autocal(0);
+	rf->div_ch = 0;
+}
+
+void rfb_div_enable(struct rf_buff* rf, unsigned char ch)
+{
+	rf->div_cal[0].ch = ch;
+	rf->div_on = 1;
+	rfb_div_calibrate(rf);
+}
+
+void rfb_div_disable(struct rf_buff* rf)
+{
+	if (!rf->div_on)
+		return;
+	rf->div_on = 0;
+	rf_set_autocal(1);
+	rf_set_channel(rf->div_cal[0].ch);
+}
+
+void rfb_div_select(struct rf_buff* rf, int i)
+{
+	if (!rf->div_on)
+		return;
+	rf->div_ch = i & 1;
+	rf_set_channel_cal(&rf->div_cal[rf->div_ch]);
 }
 
 int rfb_chk_rx_err(struct rf_buff* rf, int type)
 {
+	int err;
 	if (!rf->rx.li.crc_ok)
-		return err_crc;
-	if (type >= 0 && rf->rx.p.type != type)
-		return err_proto;
-	if (rf->rx.p.type != pkt_setup && rf->rx.p.se != rf->tx.se || (rf->master && rf->rx.p.sn != rf->tx.sn))
-		return err_session;
-	if (!rf->master && rf->rx.p.type == pkt_setup)
-		rf->tx.se = rf->rx.p.se;
-	if (rf->rx.p.err)
-		return rf->rx.p.err | err_remote;
-	return 0;
+		err = err_crc;
+	else if (type >= 0 && rf->rx.p.type != type)
+		err = err_proto;
+	else if (rf->rx.p.type != pkt_setup && rf->rx.p.se != rf->tx.se || (rf->master && rf->rx.p.sn != rf->tx.sn))
+		err = err_session;
+	else {
+		if (!rf->master && rf->rx.p.type == pkt_setup) {
+			// New session, the link quality reported is not relevant
+			rf->tx.se = rf->rx.p.se;
+			rf->tx.li = rf->rx.li;
+			rfb_set_power(rf, 0);
+		} else
+			rfb_power_control(rf);
+		err = rf->rx.p.err ? rf->rx.p.err | err_remote : 0;
+	}
+	if (err == err_crc && rf->pa_level)
+		// The link is probably weak, the remote side is likely
+		// having problems as well so restore power
+		rfb_power_up(rf);
+	if (err) {
+		trace(tr_rx_err, err);
+		if (!rf->master)
+			// Errors will be reported to master
+			rf->tx.err |= err;
+	} else
+		trace(tr_rx, rf->rx.p.type);
+	return err;
 }
 
-int rfb_receive_msg_(struct rf_buff* rf, int type, int (*cb)(void))
+static void rfb_wait(struct rf_buff* rf)
 {
-	int err;
-	rf_rx_on();
-	while (!rf_rx_test()) {
-		if (cb && 0 > (err = cb())) {
-			rf_rx_off();
-			return err;
+	do
+		sched_wait(ev_radio);
+	while (!rfb_complete(rf));
+}
+
+void rfb_send_msg(struct rf_buff* rf, unsigned char type)
+{
+	rfb_send(rf, type);
+	rfb_wait(rf);
+}
+
+int rfb_receive_msg(struct rf_buff* rf, int type)
+{
+	rfb_listen(rf);
+	rfb_wait(rf);
+	return rfb_chk_rx_err(rf, type);
+}
+
+int rfb_receive_msg_tout(struct rf_buff* rf, int type, unsigned ticks)
+{
+	rfb_listen(rf);
+	sched_timer_start(ev_delay, ticks);
+	for (;;) {
+		unsigned ev = sched_wait(ev_radio|ev_delay);
+		if ((ev & ev_radio) && rfb_complete(rf)) {
+			sched_timer_stop(ev_delay);
+			return rfb_chk_rx_err(rf, type);
+		}
+		if (ev & ev_delay) {
+			rfb_cancel(rf);
+			return -1;
 		}
 	}
-	rf_rx_read((unsigned char*)&rf->rx, sizeof(rf->rx));
-	if ((err = rfb_chk_rx_err(rf, type)) && !rf->master)
-		// Errors will be reported to master
-		rf->tx.err |= err;
-	return err;
 }
 
 void rfb_err_msg(int err)
@@ -57,3 +289,12 @@ void rfb_err_msg(int err)
 		display_msg("ErrS");
 }
 
+// The radio end of packet interrupt
+#pragma vector=CC1101_VECTOR
+__interrupt void CC1101_ISR(void)
+{
+	// Leave the flag to be tested by rfb_complete()
+	RF1AIE &= ~BIT9;
+	sched_post(ev_radio);
+	__low_power_mode_off_on_exit();
+}
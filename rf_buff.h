@@ -8,49 +8,125 @@ struct rf_buff {
 	struct packet      tx;
 	struct packet_buff rx;
 	int                master;
+	int                mode; // Operation in progress (rfb_xxx)
+	int                deferrals;     // The current packet transmission deferrals
+	unsigned           cca_deferrals; // The total number of deferrals due to busy channel
+	unsigned           rnd;           // Backoff random generator state
+	int                pa_level;      // TX power level, 0 is the max power
+	struct rf_cal      div_cal[2];    // The diversity channels calibration
+	unsigned char      div_on;        // Diversity mode enabled
+	unsigned char      div_ch;        // The current diversity channel index
 };
 
 /*
- * We are using synchronous approach here.
- * The functions will wait till operation completion. Functions with _ suffix will
- * call idle callback passed as the last parameter to support background activities.
+ * The asynchronous API. The operation is started by rfb_send() or rfb_listen()
+ * and completed by rfb_complete() upon ev_radio event posted by the radio ISR.
+ * The packets are sent after listening the channel. If it is busy the sending
+ * is retried upon ev_radio posted by the backoff timer (see backoff.h).
  */
+enum {
+	rfb_idle,
+	rfb_sending,
+	rfb_listening,
+	rfb_deferred, // Waiting for the channel to become clear
+};
 
-void rfb_send_msg_(struct rf_buff* rf, unsigned char type, void (*cb)(void));
-int rfb_receive_msg_(struct rf_buff* rf, int type, int (*cb)(void));
+void rfb_send(struct rf_buff* rf, unsigned char type);
+void rfb_listen(struct rf_buff* rf);
+void rfb_cancel(struct rf_buff* rf);
+/*
+ * Returns the completed operation (rfb_sending or rfb_listening) or 0
+ * if it is still in progress. The received packet should be checked
+ * by rfb_chk_rx_err() afterwards.
+ */
+int rfb_complete(struct rf_buff* rf);
 int rfb_chk_rx_err(struct rf_buff* rf, int type);
+/*
+ * The TX power is controlled by the link quality reported by the remote
+ * side in every packet. Set the power level explicitly (0 is the max power).
+ */
+void rfb_set_power(struct rf_buff* rf, int level);
 void rfb_err_msg(int err);
 
-static inline void rfb_init_master(struct rf_buff* rf, unsigned char se)
+/* The packet or the reply is lost, step the TX power up */
+static inline void rfb_power_up(struct rf_buff* rf)
 {
-	rf->master = 1;
-	rf->tx.se = se;
+	rfb_set_power(rf, rf->pa_level - 1);
+}
+
+/*
+ * Diversity mode. The critical messages are repeated on 2 channels selected
+ * alternately by rfb_div_select() while the receiver is hopping between them
+ * every RFB_DIV_DWELL_TICKS unless the packet reception is in progress.
+ * The dwell time should be long enough to detect the preamble (4 bits) while
+ * the preamble (32 bits) takes several dwell periods. The second channel is
+ * derived from the working one so it is known to both sides. Both channels
+ * are calibrated when the mode is enabled so switching is fast.
+ */
+#define RFB_DIV_DWELL_TICKS 40
+#define RFB_DIV_SPACING     0x20
+
+static inline unsigned char rfb_div_channel(unsigned char ch)
+{
+	ch ^= RFB_DIV_SPACING;
+	return ch != CTL_CHANNEL ? ch : ch + 1;
+}
+
+/* Enable diversity on the given working channel. The radio should be idle. */
+void rfb_div_enable(struct rf_buff* rf, unsigned char ch);
+/* Return to the working channel and the automatic calibration. The radio should be idle. */
+void rfb_div_disable(struct rf_buff* rf);
+/* Repeat calibration to follow the temperature drift if diversity is enabled. The radio should be idle. */
+void rfb_div_calibrate(struct rf_buff* rf);
+/* Select the channel by index (taken modulo 2). Does nothing unless diversity is enabled. */
+void rfb_div_select(struct rf_buff* rf, int i);
+
+/* Returns the working channel */
+static inline unsigned char rfb_channel(struct rf_buff const* rf)
+{
+	return rf->div_on ? rf->div_cal[0].ch : rf_get_channel();
 }
 
-static inline void rfb_send_msg(struct rf_buff* rf, unsigned char type)
+/*
+ * The synchronous API. The functions will wait till operation completion
+ * sleeping in the scheduler. The events other than ev_radio are left pending.
+ */
+
+void rfb_send_msg(struct rf_buff* rf, unsigned char type);
+int rfb_receive_msg(struct rf_buff* rf, int type);
+/* Same as above but returns -1 if nothing is received in the given number of ticks */
+int rfb_receive_msg_tout(struct rf_buff* rf, int type, unsigned ticks);
+
+/* Returns the random number. The high bits are more random than the low ones. */
+unsigned rfb_rand(struct rf_buff* rf);
+
+/*
+ * The session ID is used as the radio address so the packets of the other
+ * sessions sharing the channel are filtered out. Zero is reserved.
+ */
+static inline void rfb_set_session(struct rf_buff* rf, unsigned char se)
 {
-	rfb_send_msg_(rf, type, 0);
+	rf->tx.se = se;
+	rf_set_addr(se);
 }
 
-static inline int rfb_receive_msg(struct rf_buff* rf, int type)
+static inline void rfb_init_master(struct rf_buff* rf, unsigned char se)
 {
-	return rfb_receive_msg_(rf, type, 0);
+	rf->master = 1;
+	rfb_set_session(rf, se);
+	rf->tx.li.crc_ok = 0;
+	rfb_set_power(rf, 0);
 }
 
-static inline int rfb_receive_valid_msg_(struct rf_buff* rf, int type, int (*cb)(void))
+static inline int rfb_receive_valid_msg(struct rf_buff* rf, int type)
 {
 	for (;;) {
-		int res = rfb_receive_msg_(rf, type, cb);
+		int res = rfb_receive_msg(rf, type);
 		if (res != err_crc)
 			return res;
 	}
 }
 
-static inline int rfb_receive_valid_msg(struct rf_buff* rf, int type)
-{
-	return rfb_receive_valid_msg_(rf, type, 0);
-}
-
 static inline void rfb_receive_msg_checked(struct rf_buff* rf, int type)
 {
 	int r = rfb_receive_msg(rf, type);
@@ -59,4 +135,3 @@ static inline void rfb_receive_msg_checked(struct rf_buff* rf, int type)
 		stop();
 	}
 }
-
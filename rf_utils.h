@@ -10,8 +10,33 @@
 #include "utils.h"
 
 #define RF_WHITENING   0x40 // Enabled
+#define RF_VAR_LENGTH  0x01 // Variable packet length mode, the first byte is the length
+#define RF_CCA_MODE    0x30 // MCSM1: TX only if RSSI is below threshold and not receiving packet
+#define RF_PKTCTRL1    0x24 // Preamble quality threshold 4 bits, append status
+#define RF_ADR_CHK     0x02 // PKTCTRL1: address check, 0 is the broadcast address
+#define RF_AUTOCAL     0x30 // MCSM0 FS_AUTOCAL field
+
+// The PKTSTATUS bits
+#define RF_PKT_PQT_REACHED 0x20 // The preamble is being received
+#define RF_PKT_SFD         0x08 // The sync word is received
+
+// The radio states as returned by rf_get_state()
+#define RF_STATE_IDLE 0
+#define RF_STATE_RX   1
+
+// The RSSI settling time after entering RX
+#define RF_RSSI_SETTLE_CYCLES TICK_CYCLES
+// The RX to TX transition should complete within this time unless the channel is busy
+#define RF_TX_TURN_CYCLES TICK_CYCLES
 #define RF_PATABLE_VAL 0xc2 // Max power
 
+// The radio profile ID stored with the session, the data rate is good enough to tell them apart
+#define RF_PROFILE ((SMARTRF_SETTING_MDMCFG4 << 8) | SMARTRF_SETTING_MDMCFG3)
+
+// The RSSI in dBm given the value from the packet status byte
+#define RF_RSSI_DBM(raw) ((signed char)(raw) / 2 - 74)
+
+// The pktlen is the maximum packet length accepted
 static inline void rf_configure(unsigned char pktlen)
 {
 	//
@@ -26,6 +51,7 @@ static inline void rf_configure(unsigned char pktlen)
 	WriteSingleReg(MDMCFG2,  SMARTRF_SETTING_MDMCFG2);
 	WriteSingleReg(DEVIATN,  SMARTRF_SETTING_DEVIATN);
 	WriteSingleReg(MCSM0 ,   SMARTRF_SETTING_MCSM0);
+	WriteSingleReg(MCSM1 ,   RF_CCA_MODE);
 	WriteSingleReg(FOCCFG,   SMARTRF_SETTING_FOCCFG);
 	WriteSingleReg(FSCAL3,   SMARTRF_SETTING_FSCAL3);
 	WriteSingleReg(FSCAL2,   SMARTRF_SETTING_FSCAL2);
@@ -35,7 +61,8 @@ static inline void rf_configure(unsigned char pktlen)
 	WriteSingleReg(TEST1,    SMARTRF_SETTING_TEST1);
 	WriteSingleReg(FIFOTHR,  SMARTRF_SETTING_FIFOTHR);
 	WriteSingleReg(IOCFG0,   SMARTRF_SETTING_IOCFG0);
-	WriteSingleReg(PKTCTRL0, SMARTRF_SETTING_PKTCTRL0|RF_WHITENING);
+	WriteSingleReg(PKTCTRL1, RF_PKTCTRL1);
+	WriteSingleReg(PKTCTRL0, (SMARTRF_SETTING_PKTCTRL0 & ~3)|RF_WHITENING|RF_VAR_LENGTH);
 	WriteSingleReg(PKTLEN,   pktlen);
 }
 
@@ -78,19 +105,91 @@ static inline void rf_set_channel(unsigned char ch)
 	WriteSingleReg(CHANNR, ch);
 }
 
+static inline unsigned char rf_get_channel(void)
+{
+	return ReadSingleReg(CHANNR);
+}
+
+/*
+ * The synthesizer calibration results. Caching them for a few channels
+ * allows switching between them without the calibration taking ~800usec
+ * on every transition to RX or TX.
+ */
+struct rf_cal {
+	unsigned char ch;
+	unsigned char fscal3;
+	unsigned char fscal2;
+	unsigned char fscal1;
+};
+
+// Calibrate the synthesizer on the given channel and store the results. The radio is left idle.
+static inline void rf_calibrate(struct rf_cal* cal, unsigned char ch)
+{
+	rf_set_channel(ch);
+	Strobe(RF_SCAL);
+	rf_wait_idle();
+	cal->ch     = ch;
+	cal->fscal3 = ReadSingleReg(FSCAL3);
+	cal->fscal2 = ReadSingleReg(FSCAL2);
+	cal->fscal1 = ReadSingleReg(FSCAL1);
+}
+
+// Switch to the channel calibrated by rf_calibrate(). The radio should be idle.
+static inline void rf_set_channel_cal(struct rf_cal const* cal)
+{
+	WriteSingleReg(CHANNR, cal->ch);
+	WriteSingleReg(FSCAL3, cal->fscal3);
+	WriteSingleReg(FSCAL2, cal->fscal2);
+	WriteSingleReg(FSCAL1, cal->fscal1);
+}
+
+// The automatic calibration should be disabled while using the cached calibration results
+static inline void rf_set_autocal(int on)
+{
+	WriteSingleReg(MCSM0, on ? SMARTRF_SETTING_MCSM0 : SMARTRF_SETTING_MCSM0 & ~RF_AUTOCAL);
+}
+
+/*
+ * Accept only the packets with the given first byte (or zero). The foreign
+ * packets are dropped by the radio without waking up the CPU. Zero address
+ * accepts all packets. The radio should be idle.
+ */
+static inline void rf_set_addr(unsigned char addr)
+{
+	WriteSingleReg(ADDR, addr);
+	WriteSingleReg(PKTCTRL1, addr ? RF_PKTCTRL1|RF_ADR_CHK : RF_PKTCTRL1);
+}
+
+static inline void rf_set_power(unsigned char pa)
+{
+	WriteSinglePATable(pa);
+}
+
 static inline unsigned char rf_rssi(void)
 {
 	return (signed char)ReadSingleReg(RSSI) + 0x80;
 }
 
-static inline void rf_tx(unsigned char *buffer, unsigned char length)
+static inline void rf_tx_load(unsigned char *buffer, unsigned char length)
 {
+	WriteBurstReg(RF_TXFIFOWR, &length, 1);
 	WriteBurstReg(RF_TXFIFOWR, buffer, length);
+}
+
+static inline void rf_tx_start(void)
+{
 	RF1AIES |= BIT9;
 	RF1AIFG &= ~BIT9;
+	RF1AIE  |= BIT9;
 	Strobe(RF_STX);
 }
 
+static inline void rf_tx(unsigned char *buffer, unsigned char length)
+{
+	rf_tx_load(buffer, length);
+	rf_tx_start();
+}
+
 static inline int rf_tx_test(void)
 {
 	// Using interrupt flags is quite poorly documented.
@@ -103,10 +202,19 @@ static inline void rf_rx_read(unsigned char *buffer, unsigned char length)
 	ReadBurstReg(RF_RXFIFORD, buffer, length);
 }
 
+// Returns the length of the packet received
+static inline unsigned char rf_rx_len(void)
+{
+	unsigned char len;
+	ReadBurstReg(RF_RXFIFORD, &len, 1);
+	return len;
+}
+
 static inline void rf_rx_on(void)
 {
 	RF1AIES |= BIT9;
 	RF1AIFG &= ~BIT9;
+	RF1AIE  |= BIT9;
 	// Radio is in IDLE following a TX, so strobe SRX to enter Receive Mode
 	Strobe(RF_SRX);
 }
@@ -118,12 +226,46 @@ static inline int rf_rx_test(void)
 	return RF1AIFG & BIT9;
 }
 
+// Returns non zero if the packet reception is in progress
+static inline int rf_rx_busy(void)
+{
+	return ReadSingleReg(PKTSTATUS) & (RF_PKT_PQT_REACHED|RF_PKT_SFD);
+}
+
 static inline void rf_rx_off(void)
 {
 	// It is possible that ReceiveOff is called while radio is receiving a packet.
 	// Therefore, it is necessary to flush the RX FIFO after issuing IDLE strobe
 	// such that the RXFIFO is empty prior to receiving a packet.
+	RF1AIE &= ~BIT9;
 	Strobe(RF_SIDLE);
 	Strobe(RF_SFRX);
 	rf_wait_idle();
 }
+
+/*
+ * Listen before talk. The radio is put to RX to measure the RSSI then STX
+ * is strobed. Since CCA mode is set in MCSM1 the radio stays in RX if the
+ * channel is busy. Returns 0 in such case leaving the radio idle with the
+ * packet loaded by rf_tx_load() still in TX FIFO so the caller may retry.
+ */
+static inline int rf_tx_cca(void)
+{
+	unsigned t;
+	Strobe(RF_SRX);
+	while (rf_get_state() != RF_STATE_RX) __no_operation();
+	__delay_cycles(RF_RSSI_SETTLE_CYCLES);
+	rf_tx_start();
+	for (t = TA1R; rf_get_state() == RF_STATE_RX;)
+		if ((unsigned)(TA1R - t) > RF_TX_TURN_CYCLES) {
+			rf_rx_off();
+			return 0;
+		}
+	return 1;
+}
+
+// Discard the packet left in TX FIFO. The radio should be idle.
+static inline void rf_tx_flush(void)
+{
+	Strobe(RF_SFTX);
+}
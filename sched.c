@@ -0,0 +1,79 @@
+#include "io430.h"
+#include "sched.h"
+
+unsigned volatile g_sched_events;
+unsigned volatile g_sched_waiting;
+unsigned char volatile g_sched_alive;
+
+struct sched_timer {
+	unsigned ev;
+	unsigned ticks;
+};
+
+static struct sched_timer g_sched_timers[SCHED_TIMERS];
+
+unsigned sched_wait(unsigned mask)
+{
+	unsigned ev;
+	__disable_interrupt();
+	while (!(ev = g_sched_events & mask)) {
+		// The ISR will clear LPM bits on exit so we are returning here
+		g_sched_waiting = mask;
+		__bis_SR_register(LPM0_bits | GIE);
+		__disable_interrupt();
+	}
+	g_sched_waiting = 0;
+	g_sched_events &= ~ev;
+	sched_alive();
+	__enable_interrupt();
+	return ev;
+}
+
+void sched_timer_start(unsigned ev, unsigned ticks)
+{
+	struct sched_timer* free = 0;
+	int i;
+	__disable_interrupt();
+	g_sched_events &= ~ev;
+	for (i = 0; i < SCHED_TIMERS; ++i) {
+		struct sched_timer* t = &g_sched_timers[i];
+		if (t->ev == ev) {
+			free = t;
+			break;
+		}
+		if (!t->ev && !free)
+			free = t;
+	}
+	// Running out of timers is the programming error
+	if (free) {
+		free->ev    = ev;
+		free->ticks = ticks ? ticks : 1;
+	}
+	__enable_interrupt();
+}
+
+void sched_timer_stop(unsigned ev)
+{
+	int i;
+	__disable_interrupt();
+	for (i = 0; i < SCHED_TIMERS; ++i)
+		if (g_sched_timers[i].ev == ev)
+			g_sched_timers[i].ev = 0;
+	g_sched_events &= ~ev;
+	__enable_interrupt();
+}
+
+unsigned sched_tick(void)
+{
+	unsigned posted = 0;
+	int i;
+	for (i = 0; i < SCHED_TIMERS; ++i) {
+		struct sched_timer* t = &g_sched_timers[i];
+		if (t->ev && !--t->ticks) {
+			posted |= t->ev;
+			t->ev = 0;
+		}
+	}
+	g_sched_events |= posted;
+	return sched_wake();
+}
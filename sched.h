@@ -0,0 +1,90 @@
+#pragma once
+
+/* Cooperative event scheduler */
+
+/*
+ * The events are bits in the global mask. The interrupt handlers
+ * are posting them while the main loop is sleeping in sched_wait()
+ * until any of the events it is interested in is posted. The
+ * application defines its own events starting from ev_app.
+ */
+enum {
+	ev_radio    = 1 << 0, // Radio operation completed
+	ev_acquired = 1 << 1, // Photo detector acquisition completed
+	ev_delay    = 1 << 2, // The sched_delay() timer expired
+	ev_uart     = 1 << 3, // UART command received
+	ev_vcc      = 1 << 4, // Battery voltage sample taken
+	ev_app      = 1 << 5, // The first application defined event
+};
+
+// The number of software timers
+#define SCHED_TIMERS 4
+
+extern unsigned volatile g_sched_events;
+extern unsigned volatile g_sched_waiting; // The mask the main loop is sleeping on
+extern unsigned char volatile g_sched_alive; // The main loop heartbeat
+
+/*
+ * Post events. May be called from ISR but then the ISR
+ * should wake up the main loop on exit.
+ */
+static inline void sched_post(unsigned ev)
+{
+	g_sched_events |= ev;
+}
+
+/*
+ * Returns the posted events the main loop is sleeping on. The ISR
+ * should wake it up on exit only if it is nonzero.
+ */
+static inline unsigned sched_wake(void)
+{
+	return g_sched_events & g_sched_waiting;
+}
+
+/*
+ * Mark the main loop progress. Called by sched_wait() and the routines
+ * that may legitimately keep the main loop busy for a long time.
+ */
+static inline void sched_alive(void)
+{
+	g_sched_alive = 1;
+}
+
+/*
+ * Returns 1 if the main loop is sleeping in sched_wait() or has made
+ * progress since the last call. Called from the UI slot to decide if
+ * the watchdog should be kicked.
+ */
+static inline int sched_is_alive(void)
+{
+	int alive = g_sched_alive || g_sched_waiting;
+	g_sched_alive = 0;
+	return alive;
+}
+
+/* Clear events without waiting */
+static inline void sched_clear(unsigned ev)
+{
+	g_sched_events &= ~ev;
+}
+
+/*
+ * Sleep in LPM0 until any of the events in the given mask is posted.
+ * The posted events from the mask are cleared and returned.
+ */
+unsigned sched_wait(unsigned mask);
+
+/* Post the event after the given number of ticks. Restarts the timer if already started. */
+void sched_timer_start(unsigned ev, unsigned ticks);
+/* Cancel the timer and clear its event if already posted */
+void sched_timer_stop(unsigned ev);
+/* Timers processing routine. Called from the tick ISR. Returns nonzero if the main loop should be woken up. */
+unsigned sched_tick(void);
+
+/* Sleep for the given number of ticks */
+static inline void sched_delay(unsigned ticks)
+{
+	sched_timer_start(ev_delay, ticks);
+	sched_wait(ev_delay);
+}
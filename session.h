@@ -0,0 +1,46 @@
+#pragma once
+
+#include "nvram.h"
+#include "rf_utils.h"
+
+/*
+ * The session state persisted in nvram so the units are able to reconnect
+ * after reboot without the full handshake. The start verifies the session
+ * by pkt_resume exchange on the working channel. The finish is just
+ * listening on the working channel after reboot.
+ */
+struct nv_session {
+	unsigned      profile; // Radio profile, the session is valid only if it matches RF_PROFILE
+	unsigned      offset;  // Start offset calibration in ticks (start only)
+	unsigned char ch;      // Working channel
+	unsigned char se;      // Session ID
+	unsigned char sn;      // The last packet sequence number
+	unsigned char flags;   // The session flags (SETUP_F_XXX)
+};
+
+/* Returns the stored session or 0 if it is not valid */
+static inline struct nv_session const* session_load(void)
+{
+	struct nv_session const* s = nv_get(sizeof(*s));
+	return s && s->profile == RF_PROFILE ? s : 0;
+}
+
+static inline void session_save(unsigned char ch, unsigned char se, unsigned char sn, unsigned char flags, unsigned offset)
+{
+	struct nv_session s;
+	s.profile  = RF_PROFILE;
+	s.offset   = offset;
+	s.ch       = ch;
+	s.se       = se;
+	s.sn       = sn;
+	s.flags    = flags;
+	nv_put(&s, sizeof(s));
+}
+
+/* Invalidate the stored session so the next boot will follow the full setup */
+static inline void session_clear(void)
+{
+	struct nv_session s = {0};
+	if (session_load())
+		nv_put(&s, sizeof(s));
+}
@@ -9,37 +9,93 @@
 #include "rf_utils.h"
 #include "rf_buff.h"
 #include "packet.h"
-#include "nvram.h"
+#include "session.h"
 #include "wc.h"
+#include "sched.h"
+#include "uart.h"
+#include "trace.h"
+#include "link_stat.h"
+#include "vcc.h"
 
 // Uncomment to show signal strength indicator
 //#define SHOW_RSSI
 
-#define START_DEBOUNCE_TICKS 64
+// Uncomment to repeat the start and finish messages on 2 channels (see rf_buff.h)
+//#define DIVERSITY
 
-// Button events
+#ifdef DIVERSITY
+#define SETUP_FLAGS SETUP_F_DIVERSITY
+#else
+#define SETUP_FLAGS 0
+#endif
+
+#define START_DEBOUNCE_TICKS 80
+#define BTN_DEBOUNCE_TICKS   80
+
+// Link test is started by holding the user button or by 'p' UART command
+#define LINK_TEST_HOLD_TICKS (2*TICK_HZ)
+#define LINK_TEST_PINGS      32
+#define LINK_TEST_TIMEOUT    (2*TICK_HZ)
+
+// The finish is queried for the result if nothing is received for that long while running.
+// The user button press sends the query immediately.
+#define RESULT_QUERY_TICKS   (5*TICK_HZ)
+
+// Application events
 enum {
-	btn_start_pressed  = -1,
-	btn_start_released = -2,
-	btn_user           = -3,
+	ev_start_pressed  = ev_app,      // Start button pressed
+	ev_start_released = ev_app << 1, // Start button released
+	ev_user_btn       = ev_app << 2, // User button pressed
+	ev_timer          = ev_app << 3, // The state timer expired
+	ev_user_hold      = ev_app << 4, // User button held for LINK_TEST_HOLD_TICKS
 };
 
+// The state of the main loop
+typedef enum {
+	st_ready,      // Waiting status messages from the finish and buttons
+	st_ping_reply, // Replying to the ping from the finish
+	st_ping,       // Waiting the finish response to ping
+	st_running,    // Waiting the finish message
+	st_link_test,  // Waiting the finish response to echo request
+} state_t;
+
 static struct rf_buff g_rf;
 static struct wc_ctx  g_wc;
+static state_t        g_state;
 static int            g_show_clock;
+static int            g_beep;
+static volatile int   g_clock_updated;
 static unsigned       g_start_offset;
 
 static volatile unsigned g_start_pressed;
 static int               g_start_last_status;
+static unsigned          g_user_pressed;
+static unsigned          g_user_held;
+static unsigned          g_start_press_ticks; // The tick preceding the button press
+static unsigned          g_start_press_frac;  // The press time after that tick in SMCLK cycles
+
+static struct link_stat  g_link_stat;
+static unsigned          g_link_ping_ts;
+
+static struct run_result g_sync_res[BATCH_WINDOW][BATCH_RESULTS];
+static unsigned char     g_sync_cnt[BATCH_WINDOW];
+
+static int               g_low_batt_shown;
+
+// The beeper is driven from the UI slot
+static inline void beep(int duration)
+{
+	g_beep = duration;
+}
 
 static inline void beep_on()
 {
-	P1OUT |= BEEP_BIT;
+	g_beep = -1;
 }
 
 static inline void beep_off()
 {
-	P1OUT &= ~BEEP_BIT;
+	g_beep = 0;
 }
 
 static void show_channel_info(unsigned char ch)
@@ -86,16 +142,17 @@ static void reset_channel(unsigned char ch)
 	rfb_send_msg(&g_rf, pkt_reset);
 }
 
-static void test_channel(unsigned char ch, unsigned char flags)
+/*
+ * Send setup message via control channel and collect the finish responses
+ * on the working channel till the end of the setup window. The first valid
+ * response is confirmed by pkt_setup_ack so the other finishes hearing the
+ * same setup will return to the control channel. Returns 0 on success.
+ */
+static int setup_exchange(unsigned char ch, unsigned char flags)
 {
-	unsigned ts;
-
-	// Show channel number
-	display_msg("Ch");
-	display_set_dp(1);
-	display_hex_(ch, 2, 2);
+	unsigned ts, elapsed;
+	int r = -1, chosen = 0;
 
-	// Send setup message via control channel
 	rf_set_channel(CTL_CHANNEL);
 	g_rf.tx.setup.chan  = ch;
 	g_rf.tx.setup.flags = flags;
@@ -105,63 +162,131 @@ static void test_channel(unsigned char ch, unsigned char flags)
 	// Switch to working channel
 	rf_set_channel(ch);
 
+	while ((elapsed = g_wc.ticks - ts) < SETUP_WINDOW) {
+		r = rfb_receive_msg_tout(&g_rf, pkt_setup_resp, SETUP_WINDOW - elapsed);
+		if (r < 0)
+			break;
+		if (r || chosen)
+			continue;
+		chosen = 1;
+		g_rf.tx.setup_ack.id = g_rf.rx.p.setup_resp.id;
+		// Calculate transmission delay
+		g_start_offset = (g_wc.ticks - ts - SETUP_RESP_DELAY - g_rf.rx.p.setup_resp.slot * SETUP_SLOT_TICKS) / 2;
+#ifdef SHOW_RSSI
+		// Handshake completed, show signal strength info
+		display_set_dp(1);
+		display_hex_(g_rf.rx.li.rssi, 0, 2);
+		display_hex_(g_rf.rx.p.li.rssi, 2, 2);
+#endif
+		if (flags & SETUP_F_TEST)
+			// The finish is not waiting for confirmation
+			return 0;
+	}
+	if (!chosen)
+		return r;
+
+	rfb_send_msg(&g_rf, pkt_setup_ack);
+	return 0;
+}
+
+static void test_channel(unsigned char ch, unsigned char flags)
+{
+	int r, tries;
+
+	// Show channel number
+	display_msg("Ch");
+	display_set_dp(1);
+	display_hex_(ch, 2, 2);
+
 	if (!(flags & SETUP_F_TEST))
 		beep_on();
 
-	// Wait response message
-	rfb_receive_msg_checked(&g_rf, pkt_setup_resp);
-	// Calculate transmission delay
-	g_start_offset = (g_wc.ticks - ts - SETUP_RESP_DELAY) / 2;
+	for (tries = SETUP_TRIES; (r = setup_exchange(ch, flags)); ) {
+		if (!--tries) {
+			beep_off();
+			if (r > 0)
+				rfb_err_msg(r);
+			else
+				display_msg("----");
+			stop();
+		}
+		// The setup may be collided with the other start, retry in the random slot
+		sched_delay((1 + (rfb_rand(&g_rf) >> 7) % SETUP_SLOTS) * SETUP_SLOT_TICKS);
+	}
 
 	beep_off();
-#ifdef SHOW_RSSI
-	// Handshake completed, show signal strength info
-	display_set_dp(1);
-	display_hex_(g_rf.rx.li.rssi, 0, 2);
-	display_hex_(g_rf.rx.p.setup_resp.li.rssi, 2, 2);
-#endif
 }
 
-// Start button debounce routine called from WDT ISR
-static void start_btn_chk(void)
+// The session ID is random and non zero
+static unsigned char new_session_id(void)
+{
+	unsigned char se = g_wc.ticks;
+	return se ? se : 1;
+}
+
+/*
+ * The start button press is timestamped by the first edge. The bouncing
+ * edges as well as button release are filtered afterwards.
+ */
+static void start_btn_press(unsigned ticks, unsigned frac)
+{
+	if (!g_start_pressed) {
+		g_start_press_ticks = ticks;
+		g_start_press_frac  = frac;
+	}
+	g_start_pressed = START_DEBOUNCE_TICKS;
+}
+
+// Buttons debounce routine called from the UI slot. Returns posted events.
+static unsigned btns_chk(void)
 {
+	unsigned ev = 0;
+	int start_pressed;
 	if (!(P1IN & START_BTN_BIT)) {
-		g_start_pressed = START_DEBOUNCE_TICKS;
+		// Normally the edge is already captured so it just holds the pressed state.
+		// The capture is served after the UI slot so it may be pending yet.
+		if (!(TA1CCTL2 & CCIFG))
+			start_btn_press(g_wc.ticks, 0);
 	} else {
 		unsigned cnt = g_start_pressed;
 		if (cnt) {
 			g_start_pressed = cnt - 1;
 		}
 	}
-}
-
-static int monitor_btns()
-{
-	int start_pressed = g_start_pressed != 0;
-	if (!(P1IN & START_BTN_BIT)) {
-		g_start_pressed = START_DEBOUNCE_TICKS;
-		start_pressed = 1;
-	}
+	start_pressed = g_start_pressed != 0;
 	if (g_start_last_status != start_pressed) {
 		g_start_last_status = start_pressed;
-		return start_pressed ? btn_start_pressed : btn_start_released;
+		ev |= start_pressed ? ev_start_pressed : ev_start_released;
 	}
 	if (!(P1IN & BTN_BIT)) {
-		return btn_user;
+		if (!g_user_pressed)
+			ev |= ev_user_btn;
+		g_user_pressed = BTN_DEBOUNCE_TICKS;
+		if (g_user_held < LINK_TEST_HOLD_TICKS && ++g_user_held == LINK_TEST_HOLD_TICKS)
+			ev |= ev_user_hold;
+	} else if (g_user_pressed) {
+		--g_user_pressed;
+	} else {
+		g_user_held = 0;
 	}
-	return 0;
+	sched_post(ev);
+	return ev;
 }
 
-static int monitor_user_btn()
+static void configure_start_capture(void)
 {
-	if (!(P1IN & BTN_BIT))
-		return btn_user;
-	return 0;
+	PMAPKEYID = PMAPKEY;
+	P1MAP3 = PM_TA1CCR2A;
+	PMAPKEYID = 0;
+	P1SEL |= START_BTN_BIT;
+	// The timebase counter is capturing falling edges on CCI2A
+	TA1CCTL2 = CM_2 | CCIS_0 | SCS | CAP | CCIE;
 }
 
 typedef enum {
 	/* Resume mode is to reconnect to finish which is already listening on the particular channel.
-	 * The start just send reset packet to the finish and then follows standard startup routine.
+	 * The start verifies the stored session by the pkt_resume exchange. If the finish does not
+	 * respond the start sends reset packet to the finish and then follows standard startup routine.
 	 */
 	mode_resume,
 	/* Begin with choosing channel
@@ -174,19 +299,33 @@ typedef enum {
 } start_mode_t;
 
 #define MODE_SELECT_DELAY (3*SHORT_DELAY_TICKS)
+#define RESUME_TIMEOUT    (2*TICK_HZ)
 
-struct stored_channel {
-	unsigned char ch;
-	unsigned char se;
-};
+static void save_session(void)
+{
+	session_save(rfb_channel(&g_rf), g_rf.tx.se, g_rf.tx.sn, g_rf.div_on ? SETUP_F_DIVERSITY : 0, g_start_offset);
+}
 
-static inline void save_channel(unsigned char ch, unsigned char se)
+// Try to reconnect to the finish using the stored session. Returns 1 on success.
+static int resume_session(struct nv_session const* s)
 {
-	struct stored_channel sch;
-	sch.ch = ch;
-	sch.se = se;
-	// Remember channel and session id
-	nv_put(&sch, sizeof(sch));
+	int r;
+	if (s->flags & SETUP_F_DIVERSITY)
+		rfb_div_enable(&g_rf, s->ch);
+	else
+		rf_set_channel(s->ch);
+	g_rf.tx.sn = s->sn + 1;
+	rfb_send_msg(&g_rf, pkt_resume);
+	r = rfb_receive_msg_tout(&g_rf, pkt_resume, RESUME_TIMEOUT);
+	if (r < 0)
+		rfb_power_up(&g_rf);
+	if (r) {
+		rfb_err_msg(r);
+		rfb_div_disable(&g_rf);
+		return 0;
+	}
+	g_start_offset = s->offset;
+	return 1;
 }
 
 static void setup_start_ports( void )
@@ -197,41 +336,138 @@ static void setup_start_ports( void )
 	P1OUT |= START_BTN_BIT;
 	g_start_pressed = START_DEBOUNCE_TICKS;
 	g_start_last_status = 1;
+	g_user_pressed = BTN_DEBOUNCE_TICKS;
 }
 
-static void beep(void)
+static void set_state(state_t st)
 {
-	beep_on();
-	wc_delay(&g_wc, SHORT_DELAY_TICKS);
-	beep_off();
+	trace(tr_state, st);
+	g_state = st;
 }
 
-static void start_and_wait(void)
+// Set state listening for the packets from the finish
+static void set_listening_state(state_t st)
+{
+	set_state(st);
+	rfb_listen(&g_rf);
+}
+
+static void start_run(void)
 {
 	int r;
-	unsigned ts;
-	// Reset clock
+	unsigned ts = g_start_press_ticks;
+	// Round the press time to the closest tick
+	if (g_start_press_frac >= TICK_CYCLES / 2)
+		++ts;
+	// That tick may be not passed yet
+	while ((int)(g_wc.ticks - ts) < 0)
+		__no_operation();
+	// Start clock from the button press
 	wc_reset(&g_wc);
-	ts = g_wc.ticks;
+	wc_advance(&g_wc, g_wc.ticks - ts);
+	trace(tr_start, trace_sat(g_start_offset + (g_wc.ticks - ts)));
 
 	// Display clock
-	display_set_dp(1);
 	g_show_clock = 1;
 
 	// Send start message
+	rfb_cancel(&g_rf);
+	sched_timer_stop(ev_timer);
 	beep_on();
 	++g_rf.tx.sn;
-	for (r = REPEAT_MSGS; r; --r) {
+	for (r = 0; r < REPEAT_MSGS; ++r) {
+		// Alternate channels in diversity mode. The offset is updated
+		// for every copy so the finish clock is the same whichever is received.
+		rfb_div_select(&g_rf, r);
 		g_rf.tx.start.offset = g_start_offset + (g_wc.ticks - ts);
 		rfb_send_msg(&g_rf, pkt_start);
-		wc_delay(&g_wc, REPEAT_MSGS_DELAY);
+		sched_delay(REPEAT_MSGS_DELAY);
 	}
 	beep_off();
 
 	// Wait finish message
-	r = rfb_receive_valid_msg(&g_rf, pkt_finish);
+	sched_timer_start(ev_timer, RESULT_QUERY_TICKS);
+	set_listening_state(st_running);
+}
+
+// Query the finish for the result in case it was lost
+static void query_result(void)
+{
+	rfb_cancel(&g_rf);
+	// Either the start or the finish packet may be lost
+	rfb_power_up(&g_rf);
+	rfb_send_msg(&g_rf, pkt_query);
+	sched_timer_start(ev_timer, RESULT_QUERY_TICKS);
+	rfb_listen(&g_rf);
+}
+
+/*
+ * Fetch all results cached by the finish by the window of pkt_batch frames
+ * and report them over UART. The frames missing are acknowledged so the
+ * finish will resend them.
+ */
+static void sync_results(void)
+{
+	unsigned char mask = 0, all = 0;
+	int tries, r, i, f, n = 0;
+
+	rfb_cancel(&g_rf);
+	display_msg("Sync");
+	++g_rf.tx.sn;
+	// Every run preceding the request
+	g_rf.tx.sync.first_sn = g_rf.tx.sn - 0x7f;
+	for (tries = BATCH_TRIES; tries; --tries) {
+		if (!all)
+			// Nothing is received yet, the request may be lost
+			rfb_send_msg(&g_rf, pkt_sync);
+		while ((r = rfb_receive_msg_tout(&g_rf, pkt_batch, BATCH_FRAME_TIMEOUT)) >= 0) {
+			struct packet const* p = &g_rf.rx.p;
+			if ((r & (err_crc|err_proto|err_session)) || p->batch.frames > BATCH_WINDOW
+				|| p->batch.frame >= p->batch.frames || p->batch.cnt > BATCH_RESULTS)
+				continue;
+			all = (1 << p->batch.frames) - 1;
+			mask |= 1 << p->batch.frame;
+			g_sync_cnt[p->batch.frame] = p->batch.cnt;
+			for (i = 0; i < p->batch.cnt; ++i)
+				g_sync_res[p->batch.frame][i] = p->batch.res[i];
+			if (mask == all)
+				break;
+		}
+		if (!all || mask != all)
+			// The request or some frames are lost
+			rfb_power_up(&g_rf);
+		if (!all)
+			continue;
+		g_rf.tx.batch_ack.mask = mask;
+		rfb_send_msg(&g_rf, pkt_batch_ack);
+		if (mask == all)
+			break;
+	}
+
+	for (f = 0; f < BATCH_WINDOW; ++f) {
+		if (!(mask & (1 << f)))
+			continue;
+		for (i = 0; i < g_sync_cnt[f]; ++i) {
+			struct run_result const* res = &g_sync_res[f][i];
+			uart_send_hex('n', res->sn);
+			uart_send_time_hex(res->time);
+			uart_send_hex('e', res->err);
+			++n;
+		}
+	}
+	if (!all || mask != all) {
+		// Not all results are received, report the frames received
+		uart_send_hex('y', mask);
+		display_msg("----");
+	} else {
+		display_msg("Sy");
+		display_hex_(n, 2, 2);
+	}
+	set_listening_state(st_ready);
+}
 
-	// Show result
+static void show_result(int r)
+{
 	g_show_clock = 0;
 	if (r & (err_proto|err_session)) {
 		rfb_err_msg(r);
@@ -241,30 +477,278 @@ static void start_and_wait(void)
 			display_set_dp_mask(~0);
 	} else {
 		// Show reported time
-		display_hex(g_rf.rx.p.finish.time);
+		display_time(g_rf.rx.p.finish.time);
 		if (r & err_crc)
 			display_set_dp_mask(~0);
 	}
 
 	// Short beep on finish
-	beep();
+	beep(SHORT_DELAY_TICKS);
+
+	// The radio is idle, follow the temperature drift
+	rfb_div_calibrate(&g_rf);
+
+	// Persist the sequence number. The flash write stalls the CPU so it
+	// is not done while the clock is running.
+	save_session();
+}
+
+/*
+ * Battery monitoring. Called on ev_vcc while ready. The flash log is
+ * written here since the flash programming stalls the CPU.
+ */
+static void monitor_vcc(void)
+{
+	vcc_log();
+	if (vcc_low() == g_low_batt_shown)
+		return;
+	g_low_batt_shown = vcc_low();
+	if (g_low_batt_shown) {
+		display_msg("bAtt");
+		beep(SHORT_DELAY_TICKS);
+	}
+}
+
+static void send_ping(void)
+{
+	if (g_state == st_ping)
+		// The previous ping was not answered
+		rfb_set_power(&g_rf, 0);
+	rfb_cancel(&g_rf);
+	beep_on();
+	display_msg("PIng");
+	rfb_send_msg(&g_rf, pkt_ping);
+	set_listening_state(st_ping);
+}
+
+/*
+ * The link test. The echo requests are sent back to back. The finish
+ * replies immediately so the round trip time is the time of two packets
+ * transmission plus the turnaround time.
+ */
+static void link_test_done(void)
+{
+	struct link_stat const* st = &g_link_stat;
+	int i;
+	// Show the average round trip time, all points lit if some replies are lost
+	display_dec(link_stat_rtt_avg(st));
+	if (st->received != st->sent)
+		display_set_dp_mask(~0);
+	beep(SHORT_DELAY_TICKS);
+	// Report the details over UART
+	uart_send_hex('c', rfb_channel(&g_rf));
+	uart_send_hex('w', g_rf.pa_level);
+	uart_send_hex('s', st->sent);
+	uart_send_hex('r', st->received);
+	uart_send_hex('e', st->crc_err);
+	uart_send_hex('p', link_stat_per(st));
+	uart_send_hex('m', st->received ? st->rtt_min : 0);
+	uart_send_hex('a', link_stat_rtt_avg(st));
+	uart_send_hex('x', st->rtt_max);
+	for (i = 0; i < LINK_HIST_BINS; ++i)
+		uart_send_hex('R', st->rssi[i]);
+	for (i = 0; i < LINK_HIST_BINS; ++i)
+		uart_send_hex('E', st->rssi_rem[i]);
+	for (i = 0; i < LINK_HIST_BINS; ++i)
+		uart_send_hex('Q', st->lqi[i]);
+	set_listening_state(st_ready);
+}
+
+static void link_test_ping(void)
+{
+	if (g_link_stat.sent >= LINK_TEST_PINGS) {
+		link_test_done();
+		return;
+	}
+	display_hex_(g_link_stat.sent, 2, 2);
+	++g_link_stat.sent;
+	++g_rf.tx.sn;
+	g_link_ping_ts = g_wc.ticks;
+	rfb_send_msg(&g_rf, pkt_echo);
+	sched_timer_start(ev_timer, LINK_TEST_TIMEOUT);
+	rfb_listen(&g_rf);
+}
+
+static void link_test_start(void)
+{
+	rfb_cancel(&g_rf);
+	sched_timer_stop(ev_timer);
+	beep_off();
+	link_stat_reset(&g_link_stat);
+	display_msg("Lt");
+	set_state(st_link_test);
+	link_test_ping();
+}
+
+static void link_test_reply(void)
+{
+	link_stat_put(&g_link_stat, g_wc.ticks - g_link_ping_ts,
+		RF_RSSI_DBM(g_rf.rx.li.rssi), RF_RSSI_DBM(g_rf.rx.p.li.rssi), g_rf.rx.li.lqi);
+	sched_timer_stop(ev_timer);
+	link_test_ping();
+}
+
+// The packet received
+static void on_packet(void)
+{
+	int r = rfb_chk_rx_err(&g_rf, g_state == st_running   ? pkt_finish :
+	                              g_state == st_ping      ? pkt_ping :
+	                              g_state == st_link_test ? pkt_echo : -1);
+	if (r == err_crc) {
+		if (g_state == st_link_test)
+			++g_link_stat.crc_err;
+		// Ignore damaged packet
+		rfb_listen(&g_rf);
+		return;
+	}
+	switch (g_state) {
+	case st_ready:
+		if (r) {
+			rfb_err_msg(r);
+			break;
+		}
+		switch (g_rf.rx.p.type) {
+		case pkt_status:
+			// Status message received
+			if (g_rf.rx.p.status.flags & sta_no_ir) {
+				display_msg("noIr");
+				beep(SHORT_DELAY_TICKS);
+			} else if (g_rf.rx.p.status.flags & sta_low_batt) {
+				display_msg("bAtt");
+				beep(SHORT_DELAY_TICKS);
+			} else
+				display_msg("Good");
+			break;
+		case pkt_ping:
+			// Ping message received, reply after delay
+			beep_on();
+			display_rssi();
+			set_state(st_ping_reply);
+			sched_timer_start(ev_timer, SHORT_DELAY_TICKS);
+			return;
+		}
+		break;
+	case st_ping:
+		// Ping response received
+		beep_off();
+		if (r)
+			rfb_err_msg(r);
+		else
+			display_rssi();
+		set_state(st_ready);
+		break;
+	case st_running:
+		if (!(r & err_remote) && (r & (err_proto|err_session)))
+			// Not the result, it will be queried later if missed
+			break;
+		sched_timer_stop(ev_timer);
+		show_result(r);
+		set_state(st_ready);
+		break;
+	case st_link_test:
+		if (!r) {
+			link_test_reply();
+			return;
+		}
+		// Ignore stale replies and other packets
+		break;
+	default:
+		break;
+	}
+	rfb_listen(&g_rf);
+}
+
+static void dispatch(unsigned ev)
+{
+	if (ev & ev_radio) {
+		if (rfb_complete(&g_rf) == rfb_listening)
+			on_packet();
+	}
+	if (ev & ev_timer) {
+		if (g_state == st_ping_reply) {
+			rfb_send_msg(&g_rf, pkt_ping);
+			beep_off();
+			set_listening_state(st_ready);
+		} else if (g_state == st_link_test) {
+			// The reply is lost
+			rfb_cancel(&g_rf);
+			rfb_power_up(&g_rf);
+			link_test_ping();
+		} else if (g_state == st_running) {
+			query_result();
+		}
+	}
+	if (ev & ev_vcc) {
+		vcc_process();
+		if (g_state == st_ready)
+			monitor_vcc();
+	}
+	if (ev & ev_uart) {
+		switch (uart_get_char()) {
+		case 'd':
+			trace_dump();
+			break;
+		case 'v':
+			vcc_report();
+			break;
+		case 'p':
+			if (g_state == st_ready || g_state == st_ping)
+				link_test_start();
+			break;
+		case 's':
+			if (g_state == st_ready || g_state == st_ping)
+				sync_results();
+			break;
+		}
+	}
+	if (ev & ev_start_pressed) {
+		/* Start button pressed */
+		trace(tr_btn, 1);
+		if (g_state != st_running)
+			start_run();
+	}
+	if (ev & ev_start_released) {
+		/* Start button released */
+		trace(tr_btn, 2);
+		if (g_state != st_running)
+			beep(SHORT_DELAY_TICKS);
+	}
+	if (ev & ev_user_btn) {
+		/* Send ping or query the result */
+		trace(tr_btn, 3);
+		if (g_state == st_ready || g_state == st_ping)
+			send_ping();
+		else if (g_state == st_running)
+			query_result();
+	}
+	if (ev & ev_user_hold) {
+		/* Run link test */
+		trace(tr_btn, 4);
+		if (g_state == st_ready || g_state == st_ping)
+			link_test_start();
+	}
 }
 
 int main( void )
 {
 	start_mode_t mode = mode_resume;
-	struct stored_channel const* sch;
+	struct nv_session const* sess;
 	unsigned char ch, se;
 
 	stop_watchdog();
 	setup_start_ports();
 	setup_clock();
+	setup_uart();
 	rf_init(sizeof(struct packet));
+	configure_timebase();
+	configure_start_capture();
 	configure_watchdog();
+	trace_init(&g_wc.ticks);
 	__enable_interrupt();
 
 	// Show battery voltage on start
 	display_vcc();
+	vcc_init();
 
 	while (!(P1IN & BTN_BIT)) {
 		/*
@@ -286,22 +770,26 @@ int main( void )
 	wait_btn();
 
 	// Use current clock as sesson id
-	se = g_wc.ticks;
-	// Query stored channel info
-	sch = nv_get(sizeof(*sch));
+	se = new_session_id();
+	// Query stored session
+	sess = session_load();
 	switch (mode) {
 	case mode_resume:
-		if (sch) {
+		if (sess) {
 			// Use stored channel info
-			ch = sch->ch;
-			se = sch->se;
+			ch = sess->ch;
+			se = sess->se;
 			show_channel_info(ch);
 			break;
 		}
 	case mode_scan:
+		if (sess) {
+			// The finish may be resumed on the old channel
+			rfb_set_session(&g_rf, sess->se);
+			reset_channel(sess->ch);
+		}
 		// Allow user to select new channel
-		ch = scan_select_channel(sch ? sch->ch : 0);
-		save_channel(ch, se);
+		ch = scan_select_channel(sess ? sess->ch : 0);
 		break;
 	case mode_test:
 		ch = 0;
@@ -311,93 +799,88 @@ int main( void )
 	for (;;) {
 		rfb_init_master(&g_rf, se);
 
-		if (mode == mode_resume) {
+		if (mode == mode_resume && sess) {
+			if (resume_session(sess))
+				break;
 			reset_channel(ch);
-			wc_delay(&g_wc, SHORT_DELAY_TICKS);
+			sched_delay(SHORT_DELAY_TICKS);
 		}
 
 		// Test selected channel
-		test_channel(ch, mode == mode_test ? SETUP_F_TEST : 0);
+		test_channel(ch, mode == mode_test ? SETUP_F_TEST : SETUP_FLAGS);
 
-		if (mode != mode_test)
+		if (mode != mode_test) {
+			if (SETUP_FLAGS & SETUP_F_DIVERSITY)
+				rfb_div_enable(&g_rf, ch);
+			// Remember the session to be able to resume it after reboot
+			save_session();
 			break;
+		}
 
-		wc_delay(&g_wc, SHORT_DELAY_TICKS);
-		se = g_wc.ticks;
+		sched_delay(SHORT_DELAY_TICKS);
+		se = new_session_id();
 
 		// Autoincrement channel
 		do { ++ch; } while (ch == CTL_CHANNEL);
 	}
 
-	for (;;) {
-		int r;
-		// Wait status message or the start button press
-		if (!(r = rfb_receive_valid_msg_(&g_rf, -1, monitor_btns)))
-		{
-			switch (g_rf.rx.p.type) {
-			case pkt_status:
-				// Status message received
-				if (g_rf.rx.p.status.flags & sta_no_ir) {
-					display_msg("noIr");
-					beep();
-				} else
-					display_msg("Good");
-				break;
-			case pkt_ping:
-				// Ping message received
-				beep_on();
-				display_rssi();
-				wc_delay(&g_wc, SHORT_DELAY_TICKS);
-				rfb_send_msg(&g_rf, pkt_ping);
-				beep_off();
-				break;
-			}
-			continue;
-		}
-		if (r == btn_user)
-		{
-			/* Send ping */
-			for (;;) {
-				wait_btn_release();
-				beep_on();
-				display_msg("PIng");
-				rfb_send_msg(&g_rf, pkt_ping);
-				r = rfb_receive_valid_msg_(&g_rf, pkt_ping, monitor_user_btn);
-				if (!r) {
-					display_rssi();
-					beep_off();
-					break;
-				}
-				if (r == btn_user) {
-					beep_off();
-					continue;
-				}
-				rfb_err_msg(r);
-				break;
-			}
-			continue;
-		}
-		if (r == btn_start_pressed) {
-			/* Start button pressed */
-			start_and_wait();
-			continue;
-		}
-		if (r == btn_start_released) {
-			/* Start button released */
-			beep();
-			continue;
-		}
-		rfb_err_msg(r);
-	}
+	// The buttons pressed so far are not the commands
+	sched_clear(ev_start_pressed|ev_start_released|ev_user_btn|ev_uart);
+
+	// Wait status messages or the buttons press
+	set_listening_state(st_ready);
+	for (;;)
+		dispatch(sched_wait(~0));
 }
 
-// Watchdog Timer interrupt service routine
-#pragma vector=WDT_VECTOR
-__interrupt void watchdog_timer(void)
+// The system tick
+#pragma vector=TIMER1_A0_VECTOR
+__interrupt void TIMER1_A0_ISR(void)
 {
-	start_btn_chk();
+	timebase_next_tick();
 	if (wc_update(&g_wc) && g_show_clock)
-		display_bin(g_wc.d);
-	display_refresh();
-	__low_power_mode_off_on_exit();
+		g_clock_updated = 1;
+	if (sched_tick())
+		__low_power_mode_off_on_exit();
+}
+
+// The UI slot and the start button capture
+#pragma vector=TIMER1_A1_VECTOR
+__interrupt void TIMER1_A1_ISR(void)
+{
+	switch (__even_in_range(TA1IV, 14)) {
+	case 2:
+		timebase_next_slot();
+		if (sched_is_alive())
+			watchdog_kick();
+		if (g_clock_updated) {
+			g_clock_updated = 0;
+			display_time_digits(g_wc.d);
+		}
+		display_refresh();
+		vcc_slot();
+		if (g_beep) {
+			if (g_beep > 0)
+				--g_beep;
+			P1OUT |= BEEP_BIT;
+		} else {
+			P1OUT &= ~BEEP_BIT;
+		}
+		if (btns_chk())
+			__low_power_mode_off_on_exit();
+		break;
+	case 4: {
+		unsigned ticks = g_wc.ticks;
+		// The last tick took place one period before the next one scheduled
+		unsigned frac  = TA1CCR2 - (TA1CCR0 - TICK_CYCLES);
+		// The tick interrupt may be pending yet
+		while (frac >= TICK_CYCLES) {
+			frac -= TICK_CYCLES;
+			++ticks;
+		}
+		start_btn_press(ticks, frac);
+		__low_power_mode_off_on_exit();
+		break;
+	}
+	}
 }
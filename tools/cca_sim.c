@@ -0,0 +1,199 @@
+/*
+ * Listen before talk simulator.
+ *
+ * Several transmitters are sending packets on the same channel at random
+ * times. Every packet overlapping with another one is lost. The simulation
+ * is run without channel assessment (every packet is sent immediately) and
+ * with the same CCA backoff the firmware is using (see backoff.h). The
+ * throughput, packet loss, delivery latency and deferrals are reported for
+ * both variants. The time is counted in system ticks.
+ *
+ * Build: gcc -O2 -I.. -o cca_sim cca_sim.c -lm
+ * Usage: cca_sim [-n transmitters] [-r packets per sec] [-a airtime] [-s sense delay] [-t seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "backoff.h"
+#include "smartrf_CC1101.h"
+
+#define TICK_HZ  1000
+#define F_XOSC   26000000.
+
+// The start packet on air: 4 bytes preamble, 4 bytes sync word (30/32 mode),
+// the length byte, 8 bytes payload (PKT_HDR_LEN + 2) and 2 bytes CRC
+#define PKT_AIR_BYTES (4 + 4 + 1 + 8 + 2)
+#define MAX_TX   64
+#define QUEUE_SZ 16
+
+struct tx {
+	unsigned long next_arrival;
+	unsigned long queue[QUEUE_SZ]; // Packet arrival times
+	int           queued;
+	unsigned long wake;            // The time of the next channel access attempt
+	int           deferrals;
+	unsigned      seed;
+	int           sending;
+	unsigned long start, end;
+	int           collided;
+};
+
+struct params {
+	int      n;       // Transmitters
+	double   rate;    // Packets per second per transmitter
+	unsigned airtime; // Packet airtime in ticks
+	unsigned sense;   // The time taken by the channel assessment in ticks
+	unsigned long duration;
+};
+
+struct result {
+	unsigned long sent, delivered, lost, dropped, deferrals, forced;
+	double        latency;
+	unsigned long latency_max;
+	unsigned long busy; // Ticks with successful packet on the air
+};
+
+static struct tx g_tx[MAX_TX];
+
+/* The data rate in baud set by the radio profile (~200 baud) */
+static double data_rate(void)
+{
+	int e = SMARTRF_SETTING_MDMCFG4 & 0xf;
+	return (256. + SMARTRF_SETTING_MDMCFG3) * (1 << e) * F_XOSC / (1UL << 28);
+}
+
+static unsigned long next_arrival(unsigned long t, double rate)
+{
+	double u = (rand() + 1.) / (RAND_MAX + 2.);
+	return t + 1 + (unsigned long)(-log(u) * TICK_HZ / rate);
+}
+
+/* Returns 1 if any transmission other than the given one is sensed at time t */
+static int channel_busy(struct params const* p, int self, unsigned long t)
+{
+	int i;
+	for (i = 0; i < p->n; ++i)
+		if (i != self && g_tx[i].sending && g_tx[i].start < t && g_tx[i].end > t)
+			return 1;
+	return 0;
+}
+
+static void start_tx(struct params const* p, int self, unsigned long t)
+{
+	struct tx* tx = &g_tx[self];
+	int i;
+	tx->sending  = 1;
+	tx->start    = t;
+	tx->end      = t + p->airtime;
+	tx->collided = 0;
+	for (i = 0; i < p->n; ++i)
+		if (i != self && g_tx[i].sending && g_tx[i].end > t)
+			g_tx[i].collided = tx->collided = 1;
+}
+
+static void simulate(struct params const* p, int cca, struct result* r)
+{
+	unsigned long t;
+	int i;
+	srand(1);
+	for (i = 0; i < p->n; ++i) {
+		struct tx* tx = &g_tx[i];
+		tx->next_arrival = next_arrival(0, p->rate);
+		tx->queued  = 0;
+		tx->wake    = 0;
+		tx->deferrals = 0;
+		tx->seed    = rand();
+		tx->sending = 0;
+	}
+	for (t = 0; t < p->duration; ++t) {
+		for (i = 0; i < p->n; ++i) {
+			struct tx* tx = &g_tx[i];
+			if (tx->sending && tx->end <= t) {
+				unsigned long lat = tx->end - tx->queue[0];
+				tx->sending = 0;
+				if (tx->collided)
+					++r->lost;
+				else {
+					++r->delivered;
+					r->busy += p->airtime;
+					r->latency += lat;
+					if (lat > r->latency_max)
+						r->latency_max = lat;
+				}
+				--tx->queued;
+				memmove(tx->queue, tx->queue + 1, tx->queued * sizeof(tx->queue[0]));
+			}
+			if (tx->next_arrival <= t) {
+				if (tx->queued < QUEUE_SZ)
+					tx->queue[tx->queued++] = t;
+				else
+					++r->dropped;
+				tx->next_arrival = next_arrival(t, p->rate);
+			}
+		}
+		for (i = 0; i < p->n; ++i) {
+			struct tx* tx = &g_tx[i];
+			if (tx->sending || !tx->queued || tx->wake > t)
+				continue;
+			if (!cca) {
+				++r->sent;
+				start_tx(p, i, t);
+				continue;
+			}
+			// The channel is sensed at the end of the assessment
+			if (tx->deferrals < CCA_MAX_DEFERRALS && channel_busy(p, i, t + p->sense)) {
+				++r->deferrals;
+				tx->wake = t + p->sense + cca_backoff(cca_rand(&tx->seed, rand() & 0xff), tx->deferrals++);
+				continue;
+			}
+			if (tx->deferrals >= CCA_MAX_DEFERRALS)
+				++r->forced;
+			tx->deferrals = 0;
+			++r->sent;
+			start_tx(p, i, t + p->sense);
+		}
+	}
+}
+
+static void report(char const* name, struct params const* p, struct result const* r)
+{
+	printf("%-6s sent %lu, delivered %lu, lost %lu (%.1f%%), queue overflow %lu\n", name,
+		r->sent, r->delivered, r->lost, r->sent ? 100. * r->lost / r->sent : 0., r->dropped);
+	printf("       throughput %.3f, latency %.1f (max %lu) ticks, deferrals %.2f per packet, forced %lu\n",
+		(double)r->busy / p->duration, r->delivered ? r->latency / r->delivered : 0.,
+		r->latency_max, r->sent ? (double)r->deferrals / r->sent : 0., r->forced);
+}
+
+int main(int argc, char* argv[])
+{
+	// The start packet takes ~770 msec at the profile data rate
+	struct params p = { .n = 3, .rate = 0.2, .sense = 2, .duration = 3600000 };
+	struct result r0 = {0}, r1 = {0};
+	int opt;
+	p.airtime = (unsigned)(PKT_AIR_BYTES * 8 * TICK_HZ / data_rate() + .5);
+	while ((opt = getopt(argc, argv, "n:r:a:s:t:")) != -1) {
+		switch (opt) {
+		case 'n': p.n       = atoi(optarg); break;
+		case 'r': p.rate    = atof(optarg); break;
+		case 'a': p.airtime = atoi(optarg); break;
+		case 's': p.sense   = atoi(optarg); break;
+		case 't': p.duration = strtoul(optarg, 0, 0) * TICK_HZ; break;
+		default:
+			fprintf(stderr, "Usage: %s [-n transmitters] [-r packets per sec] [-a airtime] "
+				"[-s sense delay] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (p.n < 1 || p.n > MAX_TX || p.rate <= 0 || !p.airtime) {
+		fprintf(stderr, "invalid parameters\n");
+		return 1;
+	}
+	simulate(&p, 0, &r0);
+	simulate(&p, 1, &r1);
+	report("aloha", &p, &r0);
+	report("cca", &p, &r1);
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Offline IR barrier filter benchmark.
+ *
+ * Replays the burst trace through the same K of M filter the finish is using
+ * and reports false triggers, misses and timing for every K/M combination.
+ * The trace is a sequence of '0' (clean) and '1' (broken) burst results as
+ * captured from the finish UART in calibration mode with XSTATUS high.
+ * The '|' character marks the real crossing, all other characters are ignored.
+ *
+ * Build: gcc -O2 -I.. -o irf_replay irf_replay.c
+ * Usage: irf_replay trace.txt
+ *        irf_replay -g bursts glitch_rate crossing_len > trace.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ir_filter.h"
+
+#define CROSSING_PERIOD 1000
+
+struct stat {
+	unsigned triggers;
+	unsigned false_triggers;
+	unsigned misses;
+	unsigned hits;
+	long     ts_err;  // Sum of the timestamp errors in bursts
+	long     delay;   // Sum of the confirmation delays in bursts
+};
+
+static char*  g_trace;
+static size_t g_len;
+
+static void load(FILE* f)
+{
+	size_t sz = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		if (c != '0' && c != '1' && c != '|')
+			continue;
+		if (g_len >= sz) {
+			sz = sz ? 2 * sz : 4096;
+			g_trace = realloc(g_trace, sz);
+		}
+		g_trace[g_len++] = c;
+	}
+}
+
+static void replay(int k, int m, struct stat* st)
+{
+	struct irf_ctx ctx;
+	size_t i;
+	unsigned burst = 0;
+	int clean = 0;
+	int armed = 1;
+	long marker = -1;
+	irf_init(&ctx, k, m);
+	for (i = 0; i < g_len; ++i) {
+		if (g_trace[i] == '|') {
+			if (marker >= 0)
+				++st->misses;
+			marker = burst;
+			continue;
+		}
+		if (!armed) {
+			// Re-arm after the barrier is clear like on the next start
+			clean = g_trace[i] == '1' ? 0 : clean + 1;
+			armed = clean >= m;
+			++burst;
+			continue;
+		}
+		if (irf_put(&ctx, g_trace[i] == '1', burst)) {
+			unsigned first = irf_first_ts(&ctx);
+			++st->triggers;
+			if (marker >= 0) {
+				++st->hits;
+				st->ts_err += (long)first - marker;
+				st->delay  += (long)burst - first;
+				marker = -1;
+			} else
+				++st->false_triggers;
+			irf_reset(&ctx);
+			armed = 0;
+			clean = 0;
+		}
+		++burst;
+	}
+	if (marker >= 0)
+		++st->misses;
+}
+
+static void generate(unsigned bursts, double glitch_rate, unsigned crossing_len)
+{
+	unsigned i, n = 0;
+	for (i = 0; i < bursts; ++i) {
+		unsigned phase = i % CROSSING_PERIOD;
+		if (phase == CROSSING_PERIOD / 2)
+			putchar('|');
+		if (phase >= CROSSING_PERIOD / 2 && phase < CROSSING_PERIOD / 2 + crossing_len)
+			putchar('1');
+		else
+			putchar(rand() < glitch_rate * RAND_MAX ? '1' : '0');
+		if (++n >= 64) {
+			putchar('\n');
+			n = 0;
+		}
+	}
+	putchar('\n');
+}
+
+int main(int argc, char* argv[])
+{
+	int k, m;
+	if (argc == 5 && argv[1][0] == '-' && argv[1][1] == 'g') {
+		generate(atoi(argv[2]), atof(argv[3]), atoi(argv[4]));
+		return 0;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s trace.txt\n       %s -g bursts glitch_rate crossing_len\n", argv[0], argv[0]);
+		return 1;
+	}
+	if (argv[1][0] == '-' && !argv[1][1])
+		load(stdin);
+	else {
+		FILE* f = fopen(argv[1], "r");
+		if (!f) {
+			perror(argv[1]);
+			return 1;
+		}
+		load(f);
+		fclose(f);
+	}
+	printf(" K  M  triggers  false  misses  ts_err  delay\n");
+	for (m = 1; m <= IRF_M_MAX; ++m)
+		for (k = 1; k <= m; ++k) {
+			struct stat st = {0};
+			replay(k, m, &st);
+			printf("%2d %2d  %8u  %5u  %6u  %6.2f  %5.2f\n", k, m,
+				st.triggers, st.false_triggers, st.misses,
+				st.hits ? (double)st.ts_err / st.hits : 0.,
+				st.hits ? (double)st.delay / st.hits : 0.);
+		}
+	return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Offline photo detector replay.
+ *
+ * Feeds the raw run records captured from the finish UART (IR_PHOTOSYNC
+ * build, calibration mode with XSTATUS high) or synthetic waveforms through
+ * the same phs_process() / phs_detect() code the finish is running.
+ * For synthetic waveforms the detection latency, false positive and miss
+ * rates are reported. The processing time is measured on the host so it
+ * is only good for comparing detector variants. Note that int is wider
+ * on the host so the overflows possible on MSP430 are not reproduced.
+ * Every broken run is also stamped the way the finish does it (see
+ * phs_crossing_time()) and checked against phs_detected_time(). The
+ * sample-hold times the acquisition slot is sized by are checked against
+ * the datasheet for every setting up to SHT_MAX on start.
+ *
+ * Build: gcc -O2 -I.. -o phs_replay phs_replay.c ../photosync_proc.c -lm
+ * Usage: phs_replay trace.bin
+ *        phs_replay [-r runs] [-p period] [-w width] [-e edge] [-d depth]
+ *                   [-n noise] [-a ambient] [-s signal] [-S sht]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "photosync.h"
+
+// The finish run period in ticks, IR_DIV(IR_RATE_PHS)
+#define RUN_TICKS 10
+
+static struct phs_ctx g_ctx;
+static double g_proc_ns;
+static unsigned long g_runs;
+static unsigned long g_fw_checks, g_fw_mismatch;
+static double g_fw_err_max;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void reset(char sht)
+{
+	memset(&g_ctx, 0, sizeof(g_ctx));
+	g_ctx.sht = sht;
+	phs_restart(&g_ctx);
+	// The sensitivity is given by the trace so autoscale is disabled
+	phs_set_mode(&g_ctx, 0, 1);
+}
+
+/* Returns the number of the sample-hold settings not matching the datasheet */
+static int sht_check(void)
+{
+	// ADC12SHTx settings 0000b-1111b in ADC12CLK cycles
+	static const unsigned datasheet[16] = {
+		4, 8, 16, 32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1024, 1024, 1024
+	};
+	int sht, err = 0;
+	for (sht = 0; sht <= SHT_MAX; ++sht) {
+		if (SHT_CYCLES(sht) != datasheet[sht]) {
+			fprintf(stderr, "sample-hold time %d for SHT %d, %u expected\n",
+				SHT_CYCLES(sht), sht, datasheet[sht]);
+			++err;
+		}
+	}
+	return err;
+}
+
+/*
+ * Check the timestamp the finish reports for the broken run. The run
+ * counter is the run start time in RUN_TICKS units.
+ */
+static void fw_check(void)
+{
+	unsigned long fw = phs_crossing_time(&g_ctx, (unsigned long)g_ctx.run * RUN_TICKS, RUN_TICKS);
+	double err = fw - phs_detected_time(&g_ctx) * RUN_TICKS / 256.;
+	++g_fw_checks;
+	if (fabs(err) > g_fw_err_max)
+		g_fw_err_max = fabs(err);
+	// Rounded to the whole tick
+	if (fabs(err) > 0.5)
+		++g_fw_mismatch;
+}
+
+static void fw_report(void)
+{
+	printf("firmware timestamps checked %lu, mismatches %lu, max error %.2f ticks\n",
+		g_fw_checks, g_fw_mismatch, g_fw_err_max);
+}
+
+/* Process one run. Returns 1 on detection. */
+static int process(char sht, unsigned sample0, unsigned sample1, int signal)
+{
+	double t;
+	if (sht != g_ctx.sht) {
+		g_ctx.sht = sht;
+		phs_restart(&g_ctx);
+	}
+	g_ctx.sample[0] = sample0;
+	g_ctx.sample[1] = sample1;
+	g_ctx.signal = signal;
+	t = now_ns();
+	phs_process(&g_ctx);
+	g_proc_ns += now_ns() - t;
+	++g_runs;
+	if (g_ctx.detected_cnt)
+		fw_check();
+	if (!g_ctx.detected)
+		return 0;
+	// Rearm like the finish does
+	phs_set_mode(&g_ctx, 0, 1);
+	return 1;
+}
+
+static int replay(FILE* f)
+{
+	unsigned char rec[PHS_REC_SZ];
+	unsigned long detections = 0;
+	int c;
+	reset(0);
+	while ((c = fgetc(f)) != EOF) {
+		unsigned s0, s1;
+		int signal;
+		if (c != PHS_REC_SYNC)
+			continue;
+		rec[0] = c;
+		if (fread(rec + 1, 1, PHS_REC_SZ - 1, f) != PHS_REC_SZ - 1)
+			break;
+		if (rec[1] > SHT_MAX)
+			continue;
+		s0 = rec[2] | (rec[3] << 8);
+		s1 = rec[4] | (rec[5] << 8);
+		signal = (short)(rec[6] | (rec[7] << 8));
+		if (process(rec[1], s0, s1, signal)) {
+			++detections;
+			printf("detected at run %lu, crossing at %.2f (%s)\n", g_runs,
+				phs_detected_time(&g_ctx) / 256., g_ctx.detected_hi ? "high" : "low");
+		}
+	}
+	printf("runs %lu, detections %lu, %.0f ns/run on host\n",
+		g_runs, detections, g_runs ? g_proc_ns / g_runs : 0.);
+	fw_report();
+	return g_fw_mismatch != 0;
+}
+
+static double gauss(void)
+{
+	double u = (rand() + 1.) / (RAND_MAX + 2.);
+	double v = (rand() + 1.) / (RAND_MAX + 2.);
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+struct synth {
+	unsigned long runs;
+	unsigned period;  // Crossing period in runs
+	unsigned width;   // Beam broken for that many runs
+	double   edge;    // Beam edge duration in runs
+	double   depth;   // Signal fraction left while broken
+	double   noise;   // Noise sigma in ADC units
+	double   ambient; // Ambient light level in ADC units
+	double   signal;  // IR signal level in ADC units
+	int      sht;
+};
+
+/* The beam attenuation at the given time */
+static double attenuation(struct synth const* sy, double t, double t0)
+{
+	double x;
+	if (t < t0 || t >= t0 + sy->width + sy->edge)
+		return 1;
+	if (t < t0 + sy->edge)
+		x = (t - t0) / sy->edge;
+	else if (t >= t0 + sy->width)
+		x = 1 - (t - t0 - sy->width) / sy->edge;
+	else
+		x = 1;
+	return 1 - (1 - sy->depth) * x;
+}
+
+static int synthetic(struct synth const* sy)
+{
+	unsigned long k, crossings = 0, hits = 0, dups = 0, false_pos = 0;
+	int bits = BURST_BITS(sy->sht);
+	double t0 = -1e9, next_t0 = sy->period;
+	double ts_err = 0, ts_err_max = 0, run_err = 0, confirm = 0;
+	int matched = 0;
+	reset(sy->sht);
+	for (k = 0; k < sy->runs; ++k) {
+		double a, s0, s1;
+		if (k >= next_t0) {
+			t0 = next_t0;
+			next_t0 += sy->period;
+			matched = 0;
+			++crossings;
+		}
+		a  = attenuation(sy, k, t0);
+		s0 = sy->ambient + sy->noise * gauss();
+		s1 = sy->ambient + sy->signal * a + sy->noise * gauss();
+		if (s0 < 0) s0 = 0;
+		if (s1 < 0) s1 = 0;
+		if (s0 > 4095) s0 = 4095;
+		if (s1 > 4095) s1 = 4095;
+		if (!process(sy->sht, (unsigned)s0, (unsigned)s1, (int)((s1 - s0) * (1 << bits))))
+			continue;
+		if (k >= t0 && k < t0 + sy->width + 2 * sy->edge + 8) {
+			if (matched) {
+				++dups;
+				continue;
+			}
+			{
+				// The run counter is 1 based
+				double ts  = phs_detected_time(&g_ctx) / 256. - 1;
+				double err = ts - t0;
+				matched = 1;
+				++hits;
+				ts_err += err;
+				if (fabs(err) > ts_err_max)
+					ts_err_max = fabs(err);
+				run_err += g_ctx.detected_run - 1 - t0;
+				confirm += k - t0;
+			}
+		} else
+			++false_pos;
+	}
+	printf("runs %lu, crossings %lu, hits %lu, misses %lu, false positives %lu, duplicates %lu\n",
+		sy->runs, crossings, hits, crossings - hits, false_pos, dups);
+	if (hits)
+		printf("timestamp error %.3f (max %.3f), without interpolation %.3f, confirmation delay %.3f runs\n",
+			ts_err / hits, ts_err_max, run_err / hits, confirm / hits);
+	printf("%.0f ns/run on host\n", g_runs ? g_proc_ns / g_runs : 0.);
+	fw_report();
+	return g_fw_mismatch != 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct synth sy = {
+		.runs = 100000, .period = 1000, .width = 20, .edge = 1.5, .depth = 0.2,
+		.noise = 8, .ambient = 1000, .signal = 400, .sht = 6
+	};
+	int opt;
+	if (sht_check())
+		return 1;
+	while ((opt = getopt(argc, argv, "r:p:w:e:d:n:a:s:S:")) != -1) {
+		switch (opt) {
+		case 'r': sy.runs    = strtoul(optarg, 0, 0); break;
+		case 'p': sy.period  = atoi(optarg); break;
+		case 'w': sy.width   = atoi(optarg); break;
+		case 'e': sy.edge    = atof(optarg); break;
+		case 'd': sy.depth   = atof(optarg); break;
+		case 'n': sy.noise   = atof(optarg); break;
+		case 'a': sy.ambient = atof(optarg); break;
+		case 's': sy.signal  = atof(optarg); break;
+		case 'S': sy.sht     = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s trace.bin\n       %s [-r runs] [-p period] [-w width] [-e edge] [-d depth] "
+				"[-n noise] [-a ambient] [-s signal] [-S sht]\n", argv[0], argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		int r;
+		FILE* f = fopen(argv[optind], "rb");
+		if (!f) {
+			perror(argv[optind]);
+			return 1;
+		}
+		r = replay(f);
+		fclose(f);
+		return r;
+	}
+	if (sy.edge <= 0)
+		sy.edge = 1e-3;
+	return synthetic(&sy);
+}
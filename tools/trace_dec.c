@@ -0,0 +1,139 @@
+/*
+ * The events trace decoder.
+ *
+ * Renders the timeline of the trace dumped by the start or finish over
+ * UART upon the 'd' command. The capture may contain other UART output,
+ * the dumps are located by the header. Every dump found is decoded.
+ *
+ * Build: gcc -O2 -I.. -o trace_dec trace_dec.c
+ * Usage: trace_dec capture.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRACE_DECODER
+#include "trace.h"
+
+#define TICK_HZ 1000
+
+static const char* ev_name(int ev)
+{
+	switch (ev) {
+	case tr_state:   return "state";
+	case tr_tx:      return "tx";
+	case tr_rx:      return "rx";
+	case tr_rx_err:  return "rx error";
+	case tr_btn:     return "button";
+	case tr_start:   return "start";
+	case tr_finish:  return "finish";
+	case tr_timeout: return "timeout";
+	case tr_no_ir:   return "no IR";
+	case tr_ir_good: return "IR good";
+	case tr_cca_busy: return "channel busy";
+	case tr_tx_pwr:  return "tx power";
+	}
+	return "?";
+}
+
+// Packet types as defined in packet.h
+static const char* pkt_name(int type)
+{
+	switch (type) {
+	case 1:    return "setup";
+	case 2:    return "setup_resp";
+	case 3:    return "start";
+	case 4:    return "finish";
+	case 5:    return "echo";
+	case 6:    return "resume";
+	case 7:    return "query";
+	case 8:    return "sync";
+	case 9:    return "batch";
+	case 10:   return "batch_ack";
+	case 11:   return "setup_ack";
+	case 0x20: return "ping";
+	case 0x40: return "status";
+	case 0x80: return "reset";
+	}
+	return "?";
+}
+
+static void print_arg(int ev, int arg)
+{
+	switch (ev) {
+	case tr_tx:
+	case tr_rx:
+		// The 0x10 flag marks the extended payload
+		printf(" %s%s", pkt_name(arg & ~0x10), arg & 0x10 ? " ext" : "");
+		break;
+	case tr_rx_err:
+		// Error flags as defined in packet.h
+		printf(" 0x%02x%s%s%s%s%s", arg,
+			arg & 0x01 ? " proto"   : "",
+			arg & 0x04 ? " session" : "",
+			arg & 0x08 ? " crc"     : "",
+			arg & 0x40 ? " timeout" : "",
+			arg & 0x80 ? " remote"  : "");
+		break;
+	case tr_state:
+	case tr_btn:
+	case tr_start:
+	case tr_finish:
+	case tr_cca_busy:
+	case tr_tx_pwr:
+		printf(" %d", arg);
+		break;
+	}
+}
+
+static int decode(FILE* f)
+{
+	unsigned char hdr[2], rec[4];
+	unsigned cnt, i, prev = 0;
+	unsigned long t = 0;
+	if (fread(hdr, 1, 2, f) != 2)
+		return -1;
+	cnt = hdr[0] | (hdr[1] << 8);
+	if (cnt > TRACE_LEN)
+		return -1;
+	printf("%u records\n", cnt);
+	for (i = 0; i < cnt; ++i) {
+		unsigned ts, delta;
+		if (fread(rec, 1, sizeof(rec), f) != sizeof(rec))
+			return -1;
+		ts = rec[0] | (rec[1] << 8);
+		// The 16 bit ticks counter wraps around in ~65 sec
+		delta = i ? (unsigned short)(ts - prev) : 0;
+		prev = ts;
+		t += delta;
+		printf("%8.3f  +%5u  %s", (double)t / TICK_HZ, delta, ev_name(rec[2]));
+		print_arg(rec[2], rec[3]);
+		printf("\n");
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	FILE* f;
+	int c, last = EOF, dumps = 0;
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s capture.bin\n", argv[0]);
+		return 1;
+	}
+	if (!(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	while ((c = fgetc(f)) != EOF) {
+		if (last == TRACE_SYNC0 && c == TRACE_SYNC1) {
+			printf("dump %d: ", ++dumps);
+			if (decode(f))
+				printf("truncated\n");
+			c = EOF;
+		}
+		last = c;
+	}
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,36 @@
+#include "trace.h"
+#include "uart.h"
+
+#ifndef NO_TRACE
+
+struct trace_rec g_trace_buff[TRACE_LEN];
+unsigned g_trace_next;
+char volatile g_trace_paused;
+unsigned volatile const* g_trace_clock;
+
+void trace_init(unsigned volatile const* clock)
+{
+	g_trace_clock = clock;
+}
+
+void trace_dump(void)
+{
+	unsigned char hdr[4];
+	unsigned next, cnt, i;
+
+	// Pause the trace so it is not altered while sending
+	g_trace_paused = 1;
+	next = g_trace_next;
+	cnt = next < TRACE_LEN ? next : TRACE_LEN;
+	hdr[0] = TRACE_SYNC0;
+	hdr[1] = TRACE_SYNC1;
+	hdr[2] = cnt;
+	hdr[3] = cnt >> 8;
+	uart_send_buff(hdr, sizeof(hdr));
+	// The oldest record goes first
+	for (i = next - cnt; i != next; ++i)
+		uart_send_buff(&g_trace_buff[i & (TRACE_LEN - 1)], sizeof(struct trace_rec));
+	g_trace_paused = 0;
+}
+
+#endif
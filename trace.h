@@ -0,0 +1,86 @@
+#pragma once
+
+/*
+ * The events trace. The timestamped records are written to the RAM ring
+ * buffer so the last TRACE_LEN events are available for dumping over UART.
+ * Writing the record takes ~30 cycles so the trace is enabled unless NO_TRACE
+ * is defined in common.h. The records are decoded by tools/trace_dec.
+ */
+
+#define TRACE_BITS 6
+#define TRACE_LEN  (1 << TRACE_BITS)
+
+// The dump header followed by the 16 bit record count and the records
+#define TRACE_SYNC0 'T'
+#define TRACE_SYNC1 'R'
+
+// The trace events
+enum {
+	tr_state = 1, // State transition, arg - the new state
+	tr_tx,        // Packet sent, arg - packet type
+	tr_rx,        // Packet received, arg - packet type
+	tr_rx_err,    // Packet rejected, arg - error mask
+	tr_btn,       // Button event, arg - 1 start pressed, 2 start released, 3 user/ping button, 4 user button held
+	tr_start,     // Run started, arg - the start offset in ticks (saturated)
+	tr_finish,    // Finish detected, arg - burst period in ticks (saturated)
+	tr_timeout,   // Run timed out
+	tr_no_ir,     // IR barrier broken
+	tr_ir_good,   // IR barrier restored
+	tr_cca_busy,  // Packet sending deferred due to busy channel, arg - deferrals so far
+	tr_tx_pwr,    // TX power changed, arg - the power level (0 is the max power)
+};
+
+// All multibyte fields are little endian
+struct trace_rec {
+	unsigned      ts;  // Timestamp in ticks
+	unsigned char ev;  // Event (tr_xxx)
+	unsigned char arg; // Event specific argument
+};
+
+#ifndef TRACE_DECODER
+
+#include "io430.h"
+#include "common.h"
+
+#ifndef NO_TRACE
+
+extern struct trace_rec g_trace_buff[TRACE_LEN];
+extern unsigned g_trace_next;
+extern char volatile g_trace_paused; // Set while dumping
+extern unsigned volatile const* g_trace_clock;
+
+/* Write trace record. May be called from ISR. */
+static inline void trace(unsigned char ev, unsigned char arg)
+{
+	struct trace_rec* r;
+	__istate_t s;
+	if (g_trace_paused)
+		return;
+	s = __get_interrupt_state();
+	__disable_interrupt();
+	r = &g_trace_buff[g_trace_next++ & (TRACE_LEN - 1)];
+	r->ts  = *g_trace_clock;
+	r->ev  = ev;
+	r->arg = arg;
+	__set_interrupt_state(s);
+}
+
+static inline unsigned char trace_sat(unsigned val)
+{
+	return val > 0xff ? 0xff : val;
+}
+
+/* Initialize trace with the clock ticks counter */
+void trace_init(unsigned volatile const* clock);
+/* Send the trace over UART. The events are not recorded while sending. */
+void trace_dump(void);
+
+#else
+
+#define trace(ev, arg)
+#define trace_sat(val) 0
+static inline void trace_init(unsigned volatile const* clock) {}
+static inline void trace_dump(void) {}
+
+#endif
+#endif
@@ -1,42 +1,137 @@
 #include "io430.h"
 #include "uart.h"
 #include "utils.h"
+#include "sched.h"
 
-void setup_uart(void)
+// The transmit queue is drained by the TX interrupt
+#define UART_TX_BUFF_SZ 64 // Power of 2
+#define UART_TX_MASK (UART_TX_BUFF_SZ - 1)
+
+static volatile int g_uart_rx = -1;
+static unsigned char g_uart_tx_buff[UART_TX_BUFF_SZ];
+static volatile unsigned g_uart_tx_head; // Written by the main loop
+static volatile unsigned g_uart_tx_tail; // Written by the ISR
+
+void setup_uart_baud(unsigned br, unsigned char brs)
 {
 	PMAPKEYID = PMAPKEY;
 	P1MAP6 = PM_UCA0TXD;  // Map UCA0TXD output to P1.6 
+	P2MAP7 = PM_UCA0RXD;  // Map UCA0RXD input to P2.7
 	PMAPKEYID = 0;
 
 	P1DIR |= BIT6; // Set P1.6 as TX output
 	P1SEL |= BIT6;
+	P2DIR &= ~UART_RX_BIT;
+	P2SEL |= UART_RX_BIT;
 
 	UCA0CTL1 = UCSWRST | UCSSEL_2; // reset + SMCLK
-	// The divider is 6500000 / 9600 = 677 = 0x2a5
-	UCA0BR0 = 0xa5;
-	UCA0BR1 = 2;
+	UCA0BR0 = br;
+	UCA0BR1 = br >> 8;
+	UCA0MCTL = brs << 1; // UCBRSx
 	UCA0CTL1 &= ~UCSWRST;
+	UCA0IE |= UCRXIE;
+}
+
+int uart_get_char(void)
+{
+	int c;
+	__disable_interrupt();
+	c = g_uart_rx;
+	g_uart_rx = -1;
+	__enable_interrupt();
+	return c;
+}
+
+// The commands receiver (only the last character is kept) and the transmit queue
+#pragma vector=USCI_A0_VECTOR
+__interrupt void USCI_A0_ISR(void)
+{
+	switch (__even_in_range(UCA0IV, 4)) {
+	case 2: // UCRXIFG
+		g_uart_rx = UCA0RXBUF;
+		sched_post(ev_uart);
+		__low_power_mode_off_on_exit();
+		break;
+	case 4: // UCTXIFG
+		if (g_uart_tx_tail != g_uart_tx_head) {
+			UCA0TXBUF = g_uart_tx_buff[g_uart_tx_tail];
+			g_uart_tx_tail = (g_uart_tx_tail + 1) & UART_TX_MASK;
+		} else
+			UCA0IE &= ~UCTXIE;
+		break;
+	}
 }
 
-static inline void uart_send_char(unsigned char c)
+static inline unsigned uart_tx_free(void)
 {
-	while (!(UCA0IFG&UCTXIFG)); // USCI_A0 TX buffer ready?
-	UCA0TXBUF = c;              // TX -> RXed character
+	return (g_uart_tx_tail - g_uart_tx_head - 1) & UART_TX_MASK;
 }
 
-void uart_send_time_hex(unsigned val)
+static inline void uart_tx_put(unsigned char c)
 {
-	int i;
-	unsigned char time[4];
-	unsigned char buff[6];
-	unpack4nibbles(val, time);
-	buff[0] =  't';
-	buff[1] = '0' + time[3];
-	buff[2] = '0' + time[2];
-	buff[3] = '0' + time[1];
-	buff[4] = '0' + time[0];
-	buff[5] =  '\n';
-	for (i = 0; i < 6; ++i) {
-		uart_send_char(buff[i]);
+	g_uart_tx_buff[g_uart_tx_head] = c;
+	g_uart_tx_head = (g_uart_tx_head + 1) & UART_TX_MASK;
+}
+
+void uart_send_char(unsigned char c)
+{
+	while (!uart_tx_free()); // Wait the ISR to make room
+	uart_tx_put(c);
+	sched_alive();
+	UCA0IE |= UCTXIE;
+}
+
+void uart_send_hex_(unsigned val, int digits)
+{
+	for (; digits; --digits) {
+		unsigned char d = (val >> (4 * (digits - 1))) & 0xf;
+		uart_send_char(d < 10 ? '0' + d : 'a' + d - 10);
 	}
 }
+
+void uart_send_hex(unsigned char tag, unsigned val)
+{
+	uart_send_char(tag);
+	uart_send_hex_(val, 4);
+	uart_send_char('\n');
+}
+
+void uart_send_str(const char* str)
+{
+	while (*str)
+		uart_send_char(*str++);
+}
+
+void uart_send_hex32(unsigned char tag, unsigned long val)
+{
+	uart_send_char(tag);
+	uart_send_hex_(val >> 16, 4);
+	uart_send_hex_(val, 4);
+	uart_send_char('\n');
+}
+
+void uart_send_bits(unsigned bits, int n)
+{
+	for (--n; n >= 0; --n) {
+		uart_send_char(bits & (1 << n) ? '1' : '0');
+	}
+}
+
+void uart_send_buff(void const* data, unsigned sz)
+{
+	unsigned char const* ptr = data;
+	for (; sz; --sz) {
+		uart_send_char(*ptr++);
+	}
+}
+
+int uart_try_send_buff(void const* data, unsigned sz)
+{
+	unsigned char const* ptr = data;
+	if (uart_tx_free() < sz)
+		return 0;
+	for (; sz; --sz)
+		uart_tx_put(*ptr++);
+	UCA0IE |= UCTXIE;
+	return 1;
+}
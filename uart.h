@@ -1,4 +1,39 @@
 #pragma once
 
-void setup_uart(void);
-void uart_send_time_hex(unsigned val);
+/*
+ * The baud rate divider for 6.5MHz SMCLK given as the integer part and
+ * the second modulation stage (UCBRSx) selecting the fractional part in 1/8 units.
+ */
+#define UART_9600   677, 0 // 6500000 / 9600   = 677.08
+#define UART_115200  56, 3 // 6500000 / 115200 = 56.42
+
+void setup_uart_baud(unsigned br, unsigned char brs);
+
+static inline void setup_uart(void)
+{
+	setup_uart_baud(UART_9600);
+}
+
+/*
+ * The output is queued and sent by the TX interrupt. The send routines
+ * are waiting only if the queue is full so they should not be called
+ * with interrupts disabled.
+ */
+void uart_send_char(unsigned char c);
+void uart_send_str(const char* str);
+/* Send the given number of low hex digits of the value */
+void uart_send_hex_(unsigned val, int digits);
+void uart_send_hex(unsigned char tag, unsigned val);
+void uart_send_hex32(unsigned char tag, unsigned long val);
+void uart_send_bits(unsigned bits, int n);
+void uart_send_buff(void const* data, unsigned sz);
+/* Queue the data without waiting. Returns 0 if there is no room for the whole buffer. */
+int  uart_try_send_buff(void const* data, unsigned sz);
+/* Returns the character received (ev_uart posted) or -1 */
+int  uart_get_char(void);
+
+/* Send time in msec */
+static inline void uart_send_time_hex(unsigned long val)
+{
+	uart_send_hex32('t', val);
+}
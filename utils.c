@@ -2,6 +2,8 @@
 #include "rf_utils.h"
 #include "display.h"
 #include "wc.h"
+#include "vcc.h"
+#include "sched.h"
 
 void stabilize_clock()
 {
@@ -53,21 +55,14 @@ void setup_ports()
 unsigned measure_vcc()
 {
 	unsigned v;
-	REFCTL0 = REFMSTR|REFON|REFVSEL_1; // 2V REF
-	ADC12CTL0 = 0;
-	ADC12CTL0  = ADC12ON|ADC12SHT0_4;
-	ADC12CTL1  = ADC12SSEL_1|ADC12SHP|ADC12DIV_6; // ACLK/6 ~ 1.1MHz
-	ADC12MCTL0 = ADC12INCH_2|ADC12SREF_1; // A2
-	ADC12CTL0 |= ADC12ENC;
+	vcc_adc_on();
 	__delay_cycles(10000);
 	ADC12CTL0 |= ADC12SC;
 	while (!(ADC12IFG & ADC12IFG0))
 		__no_operation();
 	v = ADC12MEM0;
-	ADC12CTL0 &= ~(ADC12ON|ADC12ENC);
-	REFCTL0 = 0;
-	// Here we have 4096 ~ 2V
-	return (v >> 1) - (v >> 7) - (v >> 8);
+	vcc_adc_off();
+	return vcc_scale(v);
 }
 
 void set_vcore_up(unsigned level)
@@ -105,6 +100,8 @@ int wait_btn_release_tout(struct wc_ctx* wc, unsigned ticks)
 	unsigned cnt;
 	unsigned expired = wc->ticks + ticks;
 	for (cnt = ~0; cnt; --cnt) {
+		// The wait is bounded by the timeout
+		sched_alive();
 		if ((int)(wc->ticks - expired) > 0)
 			return -1;
 		if (!(P1IN & BTN_BIT))
@@ -9,27 +9,87 @@ static inline void stop_watchdog()
 	WDTCTL = WDTPW + WDTHOLD;
 }
 
+/*
+ * The watchdog resets the system unless kicked within ~1.3 sec
+ * (6.5MHz / 8192K). It is kicked from the UI slot but only while
+ * the main loop is sleeping in sched_wait() or making progress
+ * (see sched_is_alive()). So it is catching the main loop stuck in
+ * a busy wait as well as the stalled timebase and the interrupt storms.
+ */
+#define WDT_KICK (WDTPW + WDTSSEL__ACLK + WDTCNTCL + WDTIS__8192K)
+
 static inline void configure_watchdog()
 {
-	// Interrupt rate 6.5MHz / 8192 = 793.5 Hz (1.26 msec)
-	WDTCTL = WDTPW + WDTTMSEL + WDTSSEL__ACLK + WDTCNTCL + WDTIS__8192;
-	SFRIE1 |= WDTIE; // Enable WDT interrupt
+	WDTCTL = WDT_KICK;
+}
+
+static inline void watchdog_kick()
+{
+	WDTCTL = WDT_KICK;
+}
+
+/*
+ * The system timebase. TA1 is free running on SMCLK. The CCR0
+ * interrupts at exactly TICK_HZ rate while CCR1 provides the UI
+ * slot at the same rate shifted by the half of the period. Its
+ * vector has lower priority so the display and buttons service
+ * never delays the tick. The CCR2 is left for the application.
+ */
+static inline void configure_timebase()
+{
+	TA1CCR0  = TICK_CYCLES;
+	TA1CCTL0 = CCIE;
+	TA1CCR1  = TICK_CYCLES / 2;
+	TA1CCTL1 = CCIE;
+	TA1CTL   = TASSEL_2 | MC__CONTINUOUS | TACLR;
+}
+
+// Schedule the next tick. Called from TIMER1_A0 ISR.
+static inline void timebase_next_tick()
+{
+	TA1CCR0 += TICK_CYCLES;
+}
+
+// Schedule the next UI slot. Called from TIMER1_A1 ISR.
+static inline void timebase_next_slot()
+{
+	TA1CCR1 += TICK_CYCLES;
 }
 
 static inline void configure_timer_38k()
 {
-	TA0CCR0 = 86; // Interrupt twice during the 38kHz frequency period
-	TA0CCTL0 = CCIE;
-	TA0CTL = TASSEL_2 | MC__UP; // SMCLK UP to CCR0
+	// Route TA0.1 output to the IR LED pin. The pin is switched
+	// to the timer function only for the duration of the burst.
+	PMAPKEYID = PMAPKEY;
+	P1MAP5 = PM_TA0CCR1A;
+	PMAPKEYID = 0;
+	// 38kHz square wave generated by hardware, no interrupts
+	TA0CCR0 = IR_CARRIER_PERIOD - 1;
+	TA0CCR1 = IR_CARRIER_PERIOD / 2;
+	TA0CCTL1 = OUTMOD_7; // Reset/set
+	TA0CTL = TASSEL_2; // SMCLK, stopped
 }
 
 static inline void timer_38k_enable(int en)
 {
-	if (en) {
-		TA0CTL |= TACLR;
-		TA0CCTL0 = CCIE;
-	} else
-		TA0CCTL0 = 0;
+	if (en)
+		TA0CTL |= TACLR | MC__UP;
+	else
+		TA0CTL &= ~MC_3;
+}
+
+// The burst end is signaled by the timebase CCR2 compare interrupt
+static inline void ir_burst_start()
+{
+	P1SEL |= IR_PWM_BIT;
+	TA1CCR2 = TA1R + IR_BURST_PULSES * IR_CARRIER_PERIOD;
+	TA1CCTL2 = CCIE;
+}
+
+static inline void ir_burst_stop()
+{
+	TA1CCTL2 = 0;
+	P1SEL &= ~IR_PWM_BIT;
 }
 
 static inline void reset(void)
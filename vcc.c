@@ -0,0 +1,188 @@
+#include "vcc.h"
+#include "aver.h"
+#include "flash.h"
+#include "sched.h"
+#include "uart.h"
+#include "utils.h"
+
+struct vcc_rec {
+	unsigned time; // Power on time in minutes
+	unsigned vcc;
+};
+
+#define VCC_LOG_SEGS  2
+#define VCC_LOG_LEN   (VCC_LOG_SEGS * FLASH_SEG_SZ / sizeof(struct vcc_rec))
+#define VCC_SEG_LEN   (FLASH_SEG_SZ / sizeof(struct vcc_rec))
+#define VCC_LOG_EMPTY 0xffff
+#define VCC_TIME_MAX  0xfffe
+
+/*
+ * The log ring buffer. There is always an empty record following the
+ * latest one so the head is found on power on.
+ */
+#pragma data_alignment=FLASH_SEG_SZ
+static const struct vcc_rec vcc_log_buff[VCC_LOG_LEN] @ "CODE";
+
+static struct aver_ctx   g_vcc_aver;
+static unsigned          g_vcc_last;     // The last sample
+static unsigned          g_vcc_ticks;    // Ticks since the last sample
+static volatile unsigned g_vcc_raw;      // The ADC reading
+static unsigned          g_vcc_samples;  // Samples since the last minute
+static unsigned          g_vcc_time;     // Power on time in minutes
+static unsigned          g_vcc_logged;   // The time of the last log record
+static unsigned          g_vcc_head;     // The next log record index
+static unsigned          g_vcc_room;     // The records left erased
+static char              g_vcc_low;
+static char              g_vcc_log_due;
+
+// Returns the k-th log record before the head
+static struct vcc_rec const* vcc_log_get(unsigned k)
+{
+	return &vcc_log_buff[(g_vcc_head + VCC_LOG_LEN - k) % VCC_LOG_LEN];
+}
+
+static int vcc_seg_empty(unsigned seg)
+{
+	struct vcc_rec const* r = &vcc_log_buff[seg * VCC_SEG_LEN];
+	unsigned i;
+	for (i = 0; i < VCC_SEG_LEN; ++i, ++r)
+		if (r->time != VCC_LOG_EMPTY || r->vcc != VCC_LOG_EMPTY)
+			return 0;
+	return 1;
+}
+
+void vcc_init(void)
+{
+	struct vcc_rec const* last;
+	unsigned i, seg;
+	int clear;
+	aver_reset(&g_vcc_aver);
+	g_vcc_last = measure_vcc();
+	// Find the empty record following the non empty one
+	for (i = 0; i < VCC_LOG_LEN; ++i)
+		if (vcc_log_buff[i].time == VCC_LOG_EMPTY && vcc_log_buff[(i + VCC_LOG_LEN - 1) % VCC_LOG_LEN].time != VCC_LOG_EMPTY)
+			break;
+	if (i < VCC_LOG_LEN) {
+		g_vcc_head = i;
+		// The batteries are replaced
+		clear = g_vcc_last > vcc_log_get(1)->vcc + VCC_FRESH_DELTA;
+	} else {
+		// The log is empty or not initialized
+		g_vcc_head = 0;
+		clear = vcc_log_buff[0].time != VCC_LOG_EMPTY;
+	}
+	if (clear) {
+		flash_erase(vcc_log_buff, VCC_LOG_SEGS);
+		g_vcc_head = 0;
+	}
+	last = vcc_log_get(1);
+	g_vcc_time = g_vcc_logged = last->time != VCC_LOG_EMPTY ? last->time : 0;
+	// Make room till the next power on. The last record is left empty.
+	seg = g_vcc_head / VCC_SEG_LEN;
+	if (!vcc_seg_empty((seg + 1) % VCC_LOG_SEGS))
+		flash_erase(&vcc_log_buff[(seg + 1) % VCC_LOG_SEGS * VCC_SEG_LEN], 1);
+	g_vcc_room = (seg + 1) * VCC_SEG_LEN - g_vcc_head + VCC_SEG_LEN - 1;
+}
+
+void vcc_slot(void)
+{
+	++g_vcc_ticks;
+	if (g_vcc_ticks == VCC_SAMPLE_TICKS - VCC_REF_SETTLE_TICKS) {
+		vcc_adc_on();
+		ADC12IE = ADC12IE0;
+	} else if (g_vcc_ticks >= VCC_SAMPLE_TICKS) {
+		g_vcc_ticks = 0;
+		ADC12CTL0 |= ADC12SC;
+	}
+}
+
+void vcc_process(void)
+{
+	g_vcc_last = vcc_scale(g_vcc_raw);
+	aver_put(&g_vcc_aver, g_vcc_last);
+	if (++g_vcc_samples >= VCC_SAMPLES_PER_MIN) {
+		g_vcc_samples = 0;
+		if (g_vcc_time < VCC_TIME_MAX)
+			++g_vcc_time;
+	}
+	if (!g_vcc_aver.ready)
+		return;
+	if (g_vcc_time - g_vcc_logged >= VCC_LOG_MINUTES)
+		g_vcc_log_due = 1;
+	if (vcc_value() < VCC_LOW)
+		g_vcc_low = 1;
+	else if (vcc_value() >= VCC_LOW + VCC_LOW_HYST)
+		g_vcc_low = 0;
+}
+
+unsigned vcc_value(void)
+{
+	return g_vcc_aver.ready ? aver_value(&g_vcc_aver) : g_vcc_last;
+}
+
+int vcc_low(void)
+{
+	return g_vcc_low;
+}
+
+void vcc_log(void)
+{
+	struct vcc_rec r;
+	if (!g_vcc_log_due || !g_vcc_room)
+		return;
+	g_vcc_log_due = 0;
+	r.time = g_vcc_logged = g_vcc_time;
+	r.vcc  = vcc_value();
+	flash_write(&vcc_log_buff[g_vcc_head], &r, sizeof(r));
+	g_vcc_head = (g_vcc_head + 1) % VCC_LOG_LEN;
+	--g_vcc_room;
+}
+
+unsigned vcc_remaining(void)
+{
+	unsigned i, v, n = VCC_TREND_LEN / 2;
+	unsigned long t_new = 0, t_old = 0, v_new = 0, v_old = 0, r;
+	// Fit the slope through the centers of the newer and older halves of the trend window
+	for (i = 1; i <= VCC_TREND_LEN; ++i) {
+		struct vcc_rec const* rec = vcc_log_get(i);
+		if (rec->time == VCC_LOG_EMPTY)
+			return VCC_UNKNOWN;
+		if (i <= n) {
+			t_new += rec->time;
+			v_new += rec->vcc;
+		} else {
+			t_old += rec->time;
+			v_old += rec->vcc;
+		}
+	}
+	if (v_old <= v_new || t_new <= t_old)
+		// Not discharging
+		return VCC_UNKNOWN;
+	v = vcc_value();
+	if (v <= VCC_EMPTY)
+		return 0;
+	r = (unsigned long)(v - VCC_EMPTY) * (t_new - t_old) / (v_old - v_new);
+	return r < VCC_UNKNOWN ? r : VCC_UNKNOWN - 1;
+}
+
+void vcc_report(void)
+{
+	uart_send_hex('V', vcc_value());
+	uart_send_hex('L', g_vcc_low);
+	uart_send_hex('T', vcc_remaining());
+}
+
+#pragma vector=ADC12_VECTOR
+__interrupt void ADC12_ISR(void)
+{
+	switch (__even_in_range(ADC12IV, 36)) {
+	case 6: // ADC12IFG0
+		g_vcc_raw = ADC12MEM0;
+		ADC12IE = 0;
+		vcc_adc_off();
+		sched_post(ev_vcc);
+		if (sched_wake())
+			__low_power_mode_off_on_exit();
+		break;
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+/* Background battery voltage monitoring */
+
+#include "io430.h"
+#include "common.h"
+
+/*
+ * The battery sense input is sampled every VCC_SAMPLE_TICKS without busy
+ * waiting. The reference is turned on in the UI slot, the conversion is
+ * started a few slots later when the reference is settled and the result
+ * is taken by the ADC interrupt posting ev_vcc. The main loop is averaging
+ * the samples by calling vcc_process(). The values are in the units shown
+ * on power on (1/100 V).
+ *
+ * The ADC and the reference are shared with the photo detector so the
+ * monitoring can't be used in IR_PHOTOSYNC build of the finish.
+ */
+
+#define VCC_SAMPLE_TICKS TICK_HZ
+#define VCC_REF_SETTLE_TICKS 2
+
+// The power supply is regulated so the voltage goes down at the end of the battery life only
+#define VCC_LOW      320 // The low battery warning threshold
+#define VCC_LOW_HYST 5
+#define VCC_EMPTY    300 // The battery is considered exhausted
+
+/*
+ * The averaged voltage is logged to flash every VCC_LOG_MINUTES of the
+ * power on time. Every record is stamped by the power on time accumulated
+ * since the batteries were replaced, so neither the power off periods nor
+ * the busy periods the records are skipped in distort the time base. The
+ * remaining time is estimated from the slope over the last VCC_TREND_LEN
+ * records. The log survives reboots and is cleared on power on when the
+ * fresh batteries are detected (the voltage is VCC_FRESH_DELTA above the
+ * last logged one).
+ *
+ * The flash segments are erased on power on only since the erase stalls
+ * the CPU for tens of msec. The log stops when the room erased on power
+ * on is exhausted (more than 10 hours of the idle time).
+ */
+#define VCC_LOG_MINUTES 5
+#define VCC_SAMPLES_PER_MIN (60 * TICK_HZ / VCC_SAMPLE_TICKS)
+#define VCC_TREND_LEN   12
+#define VCC_FRESH_DELTA 10
+
+// The remaining time is unknown
+#define VCC_UNKNOWN 0xffff
+
+// Configure the reference and ADC to measure the battery sense input (A2)
+static inline void vcc_adc_on(void)
+{
+	REFCTL0 = REFMSTR|REFON|REFVSEL_1; // 2V REF
+	ADC12CTL0 = 0;
+	ADC12CTL0  = ADC12ON|ADC12SHT0_4;
+	ADC12CTL1  = ADC12SSEL_1|ADC12SHP|ADC12DIV_6; // ACLK/6 ~ 1.1MHz
+	ADC12MCTL0 = ADC12INCH_2|ADC12SREF_1; // A2
+	ADC12CTL0 |= ADC12ENC;
+}
+
+static inline void vcc_adc_off(void)
+{
+	ADC12CTL0 &= ~(ADC12ON|ADC12ENC);
+	REFCTL0 = 0;
+}
+
+// Convert the ADC reading to 1/100 V
+static inline unsigned vcc_scale(unsigned v)
+{
+	// Here we have 4096 ~ 2V
+	return (v >> 1) - (v >> 7) - (v >> 8);
+}
+
+/* Called on power on before the radio session is started since it may erase the log */
+void vcc_init(void);
+/* Called from the UI slot */
+void vcc_slot(void);
+/* Called on ev_vcc */
+void vcc_process(void);
+/* Returns the averaged voltage */
+unsigned vcc_value(void);
+int vcc_low(void);
+/* Write the log record if it is due. The flash write stalls the CPU so it should be called while idle. */
+void vcc_log(void);
+/* Returns the remaining time estimate in minutes or VCC_UNKNOWN */
+unsigned vcc_remaining(void);
+/* Send the voltage (V), low battery flag (L) and the remaining time (T) over UART */
+void vcc_report(void);
@@ -4,14 +4,21 @@
 
 /* Wall clock module */
 
-#define WC_DIGITS 4
+/*
+ * The time is counted in msec by the 32 bit binary counter. The BCD
+ * digits are maintained in parallel for displaying the running clock
+ * without division. They are 1/100 sec, 1/10 sec, sec, 10 sec, min
+ * and 10 min, the least significant first. The clock wraps around
+ * in 100 minutes.
+ */
+#define WC_DIGITS 6
 
-/* We are expecting 793.5 Hz update rate (26MHz / (4*8192)) */
-#define WC_DIV 7935
-/* We are measuring time in 1/100 sec units */
-#define WC_DELTA 1000
+/* The BCD digits are updated every 1/100 sec */
+#define WC_DIV (TICK_HZ / 100)
+#define WC_TICK_MS (1000 / TICK_HZ)
 
 struct wc_ctx {
+	unsigned long ms;
 	unsigned char d[WC_DIGITS];
 	unsigned cnt;
 	unsigned volatile ticks;
@@ -22,18 +29,24 @@ static inline void wc_reset(struct wc_ctx* wc)
 	int i;
 	for (i = 0; i < WC_DIGITS; ++i)
 		wc->d[i] = 0;
+	wc->ms = 0;
 	wc->cnt = 0;
 }
 
+/*
+ * Returns the number of BCD digits changed (the highest one index + 1)
+ * or WC_DIGITS + 1 on wrap around.
+ */
 static inline int wc_tick(struct wc_ctx* wc)
 {
 	int i;
-	wc->cnt += WC_DELTA;
-	if (wc->cnt < WC_DIV)
+	wc->ms += WC_TICK_MS;
+	if (++wc->cnt < WC_DIV)
 		return 0;
-	wc->cnt -= WC_DIV;
+	wc->cnt = 0;
 	for (i = 0; i < WC_DIGITS; ++i)
-		if (++wc->d[i] < 10)
+		// The tens of seconds are counted till 6
+		if (++wc->d[i] < (i == 3 ? 6 : 10))
 			return i + 1;
 		else
 			wc->d[i] = 0;
@@ -54,25 +67,3 @@ static inline int wc_advance(struct wc_ctx* wc, int ticks)
 			res = r;
 	return res;
 }
-
-static inline unsigned wc_get_time(struct wc_ctx* wc)
-{
-	return pack4nibbles(wc->d);
-}
-
-static inline void wc_set_time(struct wc_ctx* wc, unsigned time)
-{
-	unpack4nibbles(time, wc->d);
-}
-
-static inline void wc_delay_(struct wc_ctx* wc, unsigned ticks, void (*cb)(void))
-{
-	unsigned expired = wc->ticks + ticks;
-	while (wc->ticks != expired)
-		if (cb) cb();
-}
-
-static inline void wc_delay(struct wc_ctx* wc, unsigned ticks)
-{
-	wc_delay_(wc, ticks, 0);
-}